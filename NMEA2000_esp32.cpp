@@ -26,13 +26,16 @@ Inherited object for ESP32 modules that has a TWAI driver, for use with NMEA2000
 */
 
 #include "NMEA2000_esp32.h"
+#include "NMEA2000_esp32_framelen.h"
 #include "NMEA2000.h"
 #include "driver/twai.h"
 #include "esp_err.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "freertos/projdefs.h"
 #include "hal/twai_types.h"
+#include <string.h>
 
 // http://www.bittiming.can-wiki.info/ (Clock Rate set to 80Mhz)
 // https://www.esacademy.com/en/library/calculators/sja1000-timing-calculator.html
@@ -52,7 +55,8 @@ Inherited object for ESP32 modules that has a TWAI driver, for use with NMEA2000
         .clk_src = (twai_clock_source_t)0, .quanta_resolution_hz = 0, .brp = 16, .tseg_1 = 16, .tseg_2 = 3, .sjw = 1, .triple_sampling = true \
     }
 
-#define CAN_FRAME_HEADER_BITS 52
+// Bus load is reported against the bit rate set in CAN_init
+#define CAN_BITRATE 250000
 
 bool tNMEA2000_esp32::CanInUse = false;
 
@@ -63,6 +67,31 @@ tNMEA2000_esp32::tNMEA2000_esp32(gpio_num_t _TxPin, gpio_num_t _RxPin, TickType_
     : tNMEA2000(), IsOpen(false), TxPin(_TxPin), RxPin(_RxPin), receive_wait_ticks(_rxWaitTicks)
 {
     alert_task_semaphore = xSemaphoreCreateBinary();
+    frame_logging.store(esp_log_level_get(TAG) >= ESP_LOG_INFO, std::memory_order_relaxed);
+#if ESP32_CAN_TX_GOVERNOR == 1
+    tx_governor.SetBitrate(CAN_BITRATE);
+#endif
+    for (int prio = 0; prio < 8; prio++)
+        tx_deadline_ticks[prio] = pdMS_TO_TICKS(ESP32_CAN_TX_DEADLINE_MS);
+#if ESP32_CAN_TX_LOCK
+    tx_queue_lock = xSemaphoreCreateMutex();
+#endif
+#if ESP32_CAN_TX_RETRY
+    tx_retry.Init(tx_retry_storage, ESP32_CAN_TX_RETRY_QUEUE_LEN);
+#endif
+#if ESP32_CAN_TX_EXPIRY == 1
+    for (int prio = 0; prio < 8; prio++)
+        tx_max_age_us[prio] = ESP32_CAN_TX_MAX_AGE_MS * 1000;
+#endif
+#if ESP32_CAN_TX_SHADOW
+    tx_shadow.Init(tx_shadow_storage, TX_SHADOW_SIZE);
+#endif
+#if ESP32_CAN_TX_SCHEDULER == 1
+    tx_scheduler_lock = xSemaphoreCreateMutex();
+#endif
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    tx_times.Init(tx_times_storage, TX_TIMES_SIZE);
+#endif
 }
 
 //*****************************************************************************
@@ -85,11 +114,15 @@ bool tNMEA2000_esp32::CANOpen()
 
 void tNMEA2000_esp32::CAN_init()
 {
+#if ESP32_CAN_LISTEN_ONLY == 1
+    twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(TxPin, RxPin, TWAI_MODE_LISTEN_ONLY);
+#else
     twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(TxPin, RxPin, TWAI_MODE_NORMAL);
+#endif
 
-    g_config.rx_queue_len = 32;
-    g_config.tx_queue_len = 32;
-    g_config.alerts_enabled = ALERTS_TO_WATCH;
+    g_config.rx_queue_len = ESP32_CAN_RX_QUEUE_LEN;
+    g_config.tx_queue_len = ESP32_CAN_TX_QUEUE_LEN;
+    g_config.alerts_enabled = AlertsToWatch();
 
 #ifdef ESP32_CAN_ISR_IN_IRAM
     g_config.intr_flags = ESP_INTR_FLAG_LEVEL3 | ESP_INTR_FLAG_IRAM;
@@ -98,13 +131,58 @@ void tNMEA2000_esp32::CAN_init()
 #endif
 
     twai_timing_config_t t_config = TWAI_TIMING_CONFIG_250KBITS();
-    twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+
+#if ESP32_CAN_LISTEN_ONLY == 1
+    // A sniffer sees every frame, the software filter can still be used
+    ESP_LOGI(TAG, "Listen-only mode, accepting all frames");
+#else
+    if (rx_pgns != nullptr)
+    {
+        if (BuildHwFilter(rx_pgns, hw_filter))
+        {
+            ESP_LOGI(TAG, "Acceptance filter %s code %08lx mask %08lx, estimated false accepts %d%%", hw_filter.Config.single_filter ? "single" : "dual",
+                     (unsigned long)hw_filter.Config.acceptance_code, (unsigned long)hw_filter.Config.acceptance_mask,
+                     (int)(hw_filter.FalseAcceptRatio * 100));
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Too many receive PGNs for the acceptance filter, accepting all");
+        }
+    }
+#endif
+
+    twai_filter_config_t f_config = hw_filter.Config;
 
     // Install TWAI driver
     ESP_ERROR_CHECK(twai_driver_install(&g_config, &t_config, &f_config));
 
+#if ESP32_CAN_RX_TIMESTAMPS == 1
+    // Nothing is received before twai_start below. Set before the RX task reads it.
+    rx_empty_time = esp_timer_get_time();
+#endif
+
+    if (rx_ring_size != 0)
+    {
+        uint32_t caps = rx_ring_in_psram ? MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT : MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+        tFrame *storage = (tFrame *)heap_caps_malloc(rx_ring_size * sizeof(tFrame), caps);
+
+        if (rx_ring.Init(storage, rx_ring_size))
+        {
+            rx_ring_semaphore = xSemaphoreCreateBinary();
+            xTaskCreatePinnedToCore(rx_task, "twai_rx_task", 2048, this, ESP32_CAN_RX_TASK_PRIO, nullptr, ESP32_CAN_RX_TASK_CORE);
+        }
+        else
+        {
+            ESP_LOGE(TAG, "Failed to set up RX ring of %u frames, reading the TWAI queue directly", (unsigned)rx_ring_size);
+            if (storage != nullptr)
+                heap_caps_free(storage);
+            rx_ring_size = 0;
+        }
+    }
+
     // Start TWAI driver
     ESP_ERROR_CHECK(twai_start());
+    driver_state.store(TWAI_STATE_RUNNING, std::memory_order_relaxed);
 
     // Create alert task
     xTaskCreatePinnedToCore(alert_task, "twai_alert_task", 2048, this, ALERT_TASK_PRIO, nullptr, tskNO_AFFINITY);
@@ -130,200 +208,1513 @@ void tNMEA2000_esp32::CAN_init()
 //*****************************************************************************
 bool tNMEA2000_esp32::CANSendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent)
 {
-    unsigned char prio, src, dst;
-    unsigned long pgn;
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    int64_t start = esp_timer_get_time();
+    bool sent = SendFrame(id, len, buf, wait_sent);
 
-    twai_status_info_t status_info;
+    latency[LatencySend].Record(esp_timer_get_time() - start);
+    return sent;
+#else
+    return SendFrame(id, len, buf, wait_sent);
+#endif
+}
 
+//*****************************************************************************
+bool tNMEA2000_esp32::SendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent)
+{
+#if ESP32_CAN_LISTEN_ONLY == 1
+    // The controller cannot send in listen-only mode
+    (void)id;
+    (void)len;
+    (void)buf;
+    (void)wait_sent;
+    return false;
+#else
     // Check if the driver is in the running state before trying to transmit
-    twai_get_status_info(&status_info);
+    twai_state_t state = driver_state.load(std::memory_order_relaxed);
 
-    if (status_info.state != TWAI_STATE_RUNNING)
+    if (state != TWAI_STATE_RUNNING)
     {
-        ESP_LOGE(TAG, "Failed to send CAN Frame: Driver is not in running state: %x", status_info.state);
+        tx_rejected_not_running.fetch_add(1, std::memory_order_relaxed);
+        ESP_LOGE(TAG, "Failed to send CAN Frame: Driver is not in running state: %x", state);
         return false;
     }
 
-    if (esp_log_level_get(TAG) >= ESP_LOG_INFO)
+#if ESP32_CAN_TX_LIMITER == 1
+    // Over its limit, a dropped frame counts as sent and a deferred one stays with the library
+    tCANTxLimiter::tResult limited = tx_limiter.Check(id, 1, esp_timer_get_time());
+
+    if (limited != tCANTxLimiter::Passed)
+        return limited == tCANTxLimiter::Dropped;
+#endif
+
+#if ESP32_CAN_TX_GOVERNOR == 1
+    // A frame whose fast packet frame counter is 0 may start a message, the others
+    // follow the decision made for the message they belong to
+    bool starts = len == 0 || (buf[0] & 0x1F) == 0;
+    tCANTxGovernor::tResult governed = tx_governor.Check(id, starts, 1, esp_timer_get_time());
+
+    if (governed != tCANTxGovernor::Passed)
     {
-        canIdToN2k(id, prio, pgn, src, dst);
+#if ESP32_CAN_TX_LIMITER == 1
+        tx_limiter.Refund(id, 1);
+#endif
+        return governed == tCANTxGovernor::Dropped;
+    }
+#endif
+
+    if (FrameLogging())
+        LogFrame(CANTraceSendFrame, id, len);
+
+    tFrame frame;
+    frame.id = id;
+    frame.len = len > 8 ? 8 : len;
+    memcpy(frame.data, buf, frame.len);
 
-        ESP_LOGI(TAG, "CANSendFrame Len = %d, Prio = %d, PGN = %ld, Src = %d, Dst = %d", len, prio, pgn, src, dst);
+#if ESP32_CAN_TX_SCHEDULER == 1
+    // The scheduler never blocks, a full priority queue fails and the library keeps the frame
+    (void)wait_sent;
+    bool sent = ScheduleFrames(&frame, 1, IsTxReplacePGN(id));
+#else
+    bool sent = TransmitOrDefer(&frame, 1, wait_sent ? tx_deadline_ticks[tCANTxScheduler::Priority(id)] : 0);
+#endif
+
+#if ESP32_CAN_TX_LIMITER == 1
+    // The library sends the frame again, charge it then
+    if (!sent)
+        tx_limiter.Refund(id, 1);
+#endif
+
+    return sent;
+#endif
+}
+
+//*****************************************************************************
+bool tNMEA2000_esp32::CANSendFrames(const tFrame *frames, int count, bool wait_sent)
+{
+#if ESP32_CAN_LISTEN_ONLY == 1
+    (void)frames;
+    (void)count;
+    (void)wait_sent;
+    return false;
+#else
+    twai_state_t state = driver_state.load(std::memory_order_relaxed);
+
+    if (state != TWAI_STATE_RUNNING)
+    {
+        tx_rejected_not_running.fetch_add(count, std::memory_order_relaxed);
+        ESP_LOGE(TAG, "Failed to send CAN Frames: Driver is not in running state: %x", state);
+        return false;
     }
 
-    twai_message_t message;
-    memset(&message, 0, sizeof(message));
-    message.extd = 1;
-    message.identifier = id;
-    message.data_length_code = len;
-    message.ss = 0;
-    memcpy(message.data, buf, len);
+#if ESP32_CAN_TX_LIMITER == 1
+    // The frames of one message share a PGN and are limited together
+    tCANTxLimiter::tResult limited = count > 0 ? tx_limiter.Check(frames[0].id, count, esp_timer_get_time()) : tCANTxLimiter::Passed;
 
-    // Queue message for transmission
-    esp_err_t res = twai_transmit(&message, wait_sent ? portMAX_DELAY : 0);
+    if (limited != tCANTxLimiter::Passed)
+        return limited == tCANTxLimiter::Dropped;
+#endif
 
-    if (res == ESP_OK)
+#if ESP32_CAN_TX_GOVERNOR == 1
+    tCANTxGovernor::tResult governed =
+        count > 0 ? tx_governor.Check(frames[0].id, true, count, esp_timer_get_time()) : tCANTxGovernor::Passed;
+
+    if (governed != tCANTxGovernor::Passed)
     {
-#if ESP32_CAN_STATISTICS == 1
-        if (res == ESP_OK)
-        {
-            TxBits += CAN_FRAME_HEADER_BITS + len * 8;
-            TxPackets++;
-        }
+#if ESP32_CAN_TX_LIMITER == 1
+        tx_limiter.Refund(frames[0].id, count);
 #endif
-        return true;
+        return governed == tCANTxGovernor::Dropped;
     }
+#endif
 
-    ESP_LOGE(TAG, "Failed to queue message for transmission: %d\n", res);
-    return false;
+#if ESP32_CAN_TX_SCHEDULER == 1
+    (void)wait_sent;
+    bool sent = ScheduleFrames(frames, count);
+#else
+    // One deadline for the whole message
+    TickType_t deadline = count > 0 && wait_sent ? tx_deadline_ticks[tCANTxScheduler::Priority(frames[0].id)] : 0;
+    bool sent = TransmitOrDefer(frames, count, deadline);
+#endif
+
+    if (sent && FrameLogging())
+    {
+        for (int i = 0; i < count; i++)
+            LogFrame(CANTraceSendFrames, frames[i].id, frames[i].len);
+    }
+
+#if ESP32_CAN_TX_LIMITER == 1
+    // The library sends the message again, charge it then
+    if (!sent && count > 0)
+        tx_limiter.Refund(frames[0].id, count);
+#endif
+
+    return sent;
+#endif
 }
 
+#if ESP32_CAN_TX_SCHEDULER == 1
 //*****************************************************************************
-bool tNMEA2000_esp32::CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf)
+bool tNMEA2000_esp32::ScheduleFrames(const tFrame *frames, int count, bool replace)
 {
-    twai_message_t message;
+    uint32_t needed[tCANTxScheduler::PRIORITIES] = {};
+    int64_t now = esp_timer_get_time();
+    bool admitted = true;
 
-    auto res = twai_receive(&message, receive_wait_ticks);
+    for (int i = 0; i < count; i++)
+        needed[tCANTxScheduler::Priority(frames[i].id)]++;
 
-    if (res == ESP_OK)
+    xSemaphoreTake(tx_scheduler_lock, portMAX_DELAY);
+
+    if (replace)
     {
-        if (message.extd)
+        tCANTxEntry entry;
+        entry.id = frames[0].id;
+        entry.len = frames[0].len;
+        memcpy(entry.data, frames[0].data, frames[0].len);
+
+        if (tx_scheduler.Replace(entry))
         {
-            id = message.identifier;
-            len = message.data_length_code;
+            xSemaphoreGive(tx_scheduler_lock);
+            return true;
+        }
+    }
 
-            memcpy(buf, message.data, message.data_length_code);
+#if ESP32_CAN_TX_EXPIRY == 1
+    // Make room from frames that are too old to be sent
+    tx_expired.fetch_add(tx_scheduler.Expire(now, tx_max_age_us), std::memory_order_relaxed);
+#endif
 
-            unsigned char prio, src, dst;
-            unsigned long pgn;
+    // Admit the whole message or nothing, as CANSendFrames does without the scheduler
+    for (int prio = 0; prio < tCANTxScheduler::PRIORITIES; prio++)
+    {
+        if (needed[prio] > tx_scheduler.Free(prio))
+            admitted = false;
+    }
 
-            if (esp_log_level_get(TAG) >= ESP_LOG_INFO)
-            {
-                canIdToN2k(id, prio, pgn, src, dst);
+    if (admitted)
+    {
+        tCANTxEntry entry;
+        entry.enqueued = now;
 
-                ESP_LOGI(TAG, "CANGetFrame Len = %d, Prio = %d, PGN = %ld, Src = %d, Dst = %d", len, prio, pgn, src, dst);
-            }
+        for (int i = 0; i < count; i++)
+        {
+            entry.id = frames[i].id;
+            entry.len = frames[i].len;
+            memcpy(entry.data, frames[i].data, frames[i].len);
+            tx_scheduler.Push(entry);
+        }
+    }
+    else
+    {
+        tx_scheduler.CountOverflows(count);
+    }
 
-#if ESP32_CAN_STATISTICS == 1
-            RxBits += CAN_FRAME_HEADER_BITS + message.data_length_code * 8;
-            RxPackets++;
-#endif
+    xSemaphoreGive(tx_scheduler_lock);
 
-            return true;
-        }
+    if (!admitted)
+    {
+        ESP_LOGW(TAG, "No room for %d frames in TX scheduler", count);
         return false;
     }
-    else if (res != ESP_ERR_TIMEOUT)
+
+    FeedTxScheduler();
+    return true;
+}
+
+//*****************************************************************************
+bool tNMEA2000_esp32::IsTxReplacePGN(unsigned long id) const
+{
+    if (tx_replace_pgns == nullptr)
+        return false;
+
+    unsigned char prio, src, dst;
+    unsigned long pgn;
+
+    canIdToN2k(id, prio, pgn, src, dst);
+
+    for (const unsigned long *replace = tx_replace_pgns; *replace != 0; replace++)
     {
-        ESP_LOGE(TAG, "twai_receive failed: %d", res);
+        if (*replace == pgn)
+            return true;
     }
+
     return false;
 }
 
-#if ESP32_CAN_STATISTICS == 1
-void tNMEA2000_esp32::Timer_tick(void *arg)
+//*****************************************************************************
+// Top up the TWAI TX queue with the highest priority frames. Called after
+// scheduling, by alert_task whenever the controller finishes a frame and, with
+// ESP32_CAN_TX_EXPIRY, while frames wait on a bus that holds them back.
+void tNMEA2000_esp32::FeedTxScheduler()
 {
-    tNMEA2000_esp32 *pThis = (tNMEA2000_esp32 *)arg;
+    twai_status_info_t status_info;
+
+    xSemaphoreTake(tx_scheduler_lock, portMAX_DELAY);
+
+#if ESP32_CAN_TX_EXPIRY == 1
+    tx_expired.fetch_add(tx_scheduler.Expire(esp_timer_get_time(), tx_max_age_us), std::memory_order_relaxed);
+#endif
+
+    if (driver_state.load(std::memory_order_relaxed) == TWAI_STATE_RUNNING && twai_get_status_info(&status_info) == ESP_OK)
+    {
+        uint32_t queued = status_info.msgs_to_tx;
+        const tCANTxEntry *entry;
 
-    pThis->RxPacketsPerSecond = (unsigned long)(pThis->RxPacketsPerSecond * 0.05 + pThis->RxPackets * 0.95);
-    pThis->RxPackets = 0;
+        while (queued < ESP32_CAN_TX_SCHEDULER_HW_DEPTH && (entry = tx_scheduler.Front()) != nullptr)
+        {
+            if (!TransmitFrame(entry->id, entry->len, entry->data))
+                break;
 
-    pThis->RxBitsPerSeconds = (unsigned long)(pThis->RxBitsPerSeconds * 0.05 + pThis->RxBits * 0.95);
-    pThis->RxBits = 0;
+            tx_scheduler.PopFront(esp_timer_get_time());
+            queued++;
+        }
 
-    pThis->TxPacketsPerSecond = (unsigned long)(pThis->TxPacketsPerSecond * 0.05 + pThis->TxPackets * 0.95);
-    pThis->TxPackets = 0;
+        tx_queued.fetch_add(queued - status_info.msgs_to_tx, std::memory_order_relaxed);
+    }
 
-    pThis->TxBitsPerSecond = (unsigned long)(pThis->TxBitsPerSecond * 0.05 + pThis->TxBits * 0.95);
-    pThis->TxBits = 0;
+    xSemaphoreGive(tx_scheduler_lock);
 }
-#endif
 
 //*****************************************************************************
-void tNMEA2000_esp32::InitCANFrameBuffers()
+tCANTxScheduler::tLatency tNMEA2000_esp32::GetTxLatency(int prio)
 {
-    tNMEA2000::InitCANFrameBuffers(); // call main initialization
+    tCANTxScheduler::tLatency latency = {};
+
+    if (prio < 0 || prio >= tCANTxScheduler::PRIORITIES)
+        return latency;
+
+    xSemaphoreTake(tx_scheduler_lock, portMAX_DELAY);
+    latency = tx_scheduler.GetLatency(prio);
+    xSemaphoreGive(tx_scheduler_lock);
+
+    return latency;
 }
 
-void tNMEA2000_esp32::canIdToN2k(unsigned long id, unsigned char &prio, unsigned long &pgn, unsigned char &src, unsigned char &dst)
+uint32_t tNMEA2000_esp32::GetTxScheduled()
 {
-    unsigned char CanIdPF = (unsigned char)(id >> 16);
-    unsigned char CanIdPS = (unsigned char)(id >> 8);
-    unsigned char CanIdDP = (unsigned char)(id >> 24) & 1;
+    xSemaphoreTake(tx_scheduler_lock, portMAX_DELAY);
+    uint32_t count = tx_scheduler.Count();
+    xSemaphoreGive(tx_scheduler_lock);
 
-    src = (unsigned char)id >> 0;
-    prio = (unsigned char)((id >> 26) & 0x7);
+    return count;
+}
 
-    if (CanIdPF < 240)
-    {
-        /* PDU1 format, the PS contains the destination address */
-        dst = CanIdPS;
-        pgn = (((unsigned long)CanIdDP) << 16) | (((unsigned long)CanIdPF) << 8);
-    }
-    else
+uint32_t tNMEA2000_esp32::GetTxSchedulerOverflows()
+{
+    xSemaphoreTake(tx_scheduler_lock, portMAX_DELAY);
+    uint32_t overflows = tx_scheduler.GetOverflows();
+    xSemaphoreGive(tx_scheduler_lock);
+
+    return overflows;
+}
+
+uint32_t tNMEA2000_esp32::GetTxReplaced()
+{
+    xSemaphoreTake(tx_scheduler_lock, portMAX_DELAY);
+    uint32_t replaced = tx_scheduler.GetReplaced();
+    xSemaphoreGive(tx_scheduler_lock);
+
+    return replaced;
+}
+#endif
+
+//*****************************************************************************
+// Queue one frame without waiting. Callers add the frames queued to tx_queued,
+// once per batch.
+bool tNMEA2000_esp32::TransmitFrame(unsigned long id, unsigned char len, const unsigned char *buf, int64_t enqueued)
+{
+    twai_message_t message;
+    message.flags = TWAI_MSG_FLAG_EXTD;
+    message.identifier = id;
+    message.data_length_code = len;
+    memcpy(message.data, buf, len);
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    int64_t queued = esp_timer_get_time();
+#endif
+
+    // Queue message for transmission
+    esp_err_t res = twai_transmit(&message, 0);
+
+    if (res == ESP_OK)
     {
-        /* PDU2 format, the destination is implied global and the PGN is extended */
-        dst = 0xff;
-        pgn = (((unsigned long)CanIdDP) << 16) | (((unsigned long)CanIdPF) << 8) | (unsigned long)CanIdPS;
+#if ESP32_CAN_TX_SHADOW
+        tCANTxEntry entry;
+        entry.id = id;
+        entry.len = len > 8 ? 8 : len;
+        memcpy(entry.data, buf, entry.len);
+        entry.enqueued = enqueued != 0 ? enqueued : esp_timer_get_time();
+
+        tx_shadow.Push(entry);
+        int64_t expires = TxExpiresAt(id, entry.enqueued);
+        if (expires < tx_shadow_expiry)
+            tx_shadow_expiry = expires;
+#else
+        (void)enqueued;
+#endif
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+        tx_times.Push(queued);
+#endif
+        CountFrame(id, len, buf, false);
+        return true;
     }
+
+    // The driver left the running state before alert_task updated driver_state
+    if (res == ESP_ERR_INVALID_STATE)
+        tx_rejected_not_running.fetch_add(1, std::memory_order_relaxed);
+
+    ESP_LOGE(TAG, "Failed to queue message for transmission: %d\n", res);
+    return false;
 }
 
-[[noreturn]] void tNMEA2000_esp32::alert_task(void *param)
+//*****************************************************************************
+// Queue the frames of one message in the TWAI TX queue, all or none, once there is
+// room for all of them. With the retry queue a message that finds no room within
+// wait_ticks is kept for later and counts as sent. tx_queue_lock is held while
+// queueing but never while waiting, which polls once a tick, so alert_task always
+// gets it quickly.
+bool tNMEA2000_esp32::TransmitOrDefer(const tFrame *frames, int count, TickType_t wait_ticks)
 {
-    tNMEA2000_esp32 *pThis = (tNMEA2000_esp32 *)param;
+    twai_status_info_t status_info = {};
+    TickType_t started = 0;
+    int64_t blocked_since = 0;
+    bool waiting = false;
+    bool done = false;
+    bool deferred = false;
+    int queued = 0;
+
+    while (!done)
+    {
+#if ESP32_CAN_TX_LOCK
+        xSemaphoreTake(tx_queue_lock, portMAX_DELAY);
+#endif
+#if ESP32_CAN_TX_SHADOW
+        ExpireTxQueue();
+#endif
+#if ESP32_CAN_TX_RETRY
+        RetryFrames();
+#endif
 
-    xSemaphoreTake(pThis->alert_task_semaphore, portMAX_DELAY);
+        // Every sender queues under the lock and the driver only ever frees TX queue
+        // entries, so the room seen here stays available while the frames are queued
+        bool running = twai_get_status_info(&status_info) == ESP_OK;
+        bool room = running && status_info.msgs_to_tx + count <= ESP32_CAN_TX_QUEUE_LEN;
 
-    while (true)
-    {
-        uint32_t alerts;
-        twai_read_alerts(&alerts, portMAX_DELAY);
+#if ESP32_CAN_TX_RETRY
+        // Frames still waiting to be retried go first
+        room = room && tx_retry.Count() == 0;
+#endif
 
-        if (pThis->alerts_callback != nullptr)
+        if (room)
         {
-            pThis->alerts_callback(alerts, alerts & ERROR_ALERTS_TO_WATCH);
+            while (queued < count && TransmitFrame(frames[queued].id, frames[queued].len, frames[queued].data))
+                queued++;
+            tx_queued.fetch_add(queued, std::memory_order_relaxed);
+            done = true;
         }
-
-        if (alerts & TWAI_ALERT_ABOVE_ERR_WARN)
+        else if (!running || count > ESP32_CAN_TX_QUEUE_LEN || wait_ticks == 0 || (waiting && xTaskGetTickCount() - started >= wait_ticks))
         {
-            ESP_LOGE(TAG, "One of the error counters have exceeded the error warning limit");
+            if (waiting)
+                tx_timed_out.fetch_add(1, std::memory_order_relaxed);
+            done = true;
         }
-        if (alerts & TWAI_ALERT_ERR_PASS)
+
+#if ESP32_CAN_TX_RETRY
+        // The rest of a message the driver stopped taking keeps its order there too
+        if (done && queued < count)
+            deferred = DeferFrames(frames + queued, count - queued);
+#endif
+
+#if ESP32_CAN_TX_LOCK
+        xSemaphoreGive(tx_queue_lock);
+#endif
+
+        if (!done)
         {
-            ESP_LOGE(TAG, "TWAI controller has become error passive");
+            if (!waiting)
+            {
+                started = xTaskGetTickCount();
+                blocked_since = esp_timer_get_time();
+                waiting = true;
+            }
+            vTaskDelay(1);
         }
-        if (alerts & TWAI_ALERT_BUS_OFF)
-        {
-            ESP_LOGE(TAG, "Bus-off condition occurred");
+    }
 
-            // Reconfigure alerts to detect bus recovery completion
-            twai_reconfigure_alerts(TWAI_ALERT_BUS_RECOVERED, nullptr);
+    if (waiting)
+    {
+        uint32_t blocked = (uint32_t)(esp_timer_get_time() - blocked_since);
+        uint32_t max = tx_max_blocked_us.load(std::memory_order_relaxed);
 
-            ESP_LOGE(TAG, "Initiate bus recovery");
-            twai_initiate_recovery(); // Needs 128 occurrences of bus free signal
-        }
-        if (alerts & TWAI_ALERT_BUS_RECOVERED)
+        while (blocked > max && !tx_max_blocked_us.compare_exchange_weak(max, blocked, std::memory_order_relaxed))
         {
-            // Bus recovery successful
-            ESP_LOGI(TAG, "TWAI controller has successfully completed bus recovery");
+        }
+    }
 
-            // Start TWAI driver
-            if (twai_start() == ESP_OK)
-            {
-                ESP_LOGI(TAG, "TWAI Driver started");
-            }
-            else
-            {
-                ESP_LOGE(TAG, "Failed to start driver");
-            }
+    if (queued == count || deferred)
+        return true;
+
+    tx_refused.fetch_add(count - queued, std::memory_order_relaxed);
+    ESP_LOGW(TAG, "No room for %d frames in TX queue, %d queued", count - queued, (int)status_info.msgs_to_tx);
+    return false;
+}
+
+#if ESP32_CAN_TX_RETRY
+//*****************************************************************************
+// Keep a whole message for later, or nothing. Called with tx_queue_lock held.
+bool tNMEA2000_esp32::DeferFrames(const tFrame *frames, int count)
+{
+    if ((uint32_t)count > tx_retry.Size() - tx_retry.Count())
+        return false;
+
+    tCANTxEntry entry;
+    entry.enqueued = esp_timer_get_time();
+
+    for (int i = 0; i < count; i++)
+    {
+        entry.id = frames[i].id;
+        entry.len = frames[i].len > 8 ? 8 : frames[i].len;
+        memcpy(entry.data, frames[i].data, entry.len);
+        tx_retry.Push(entry);
+    }
+
+    tx_deferred.fetch_add(count, std::memory_order_relaxed);
+    return true;
+}
+
+//*****************************************************************************
+// Move frames from the retry queue to the TWAI TX queue while there is room.
+// Frames that expired while waiting are dropped. Called with tx_queue_lock held,
+// on every send and by alert_task when the TWAI TX queue runs empty.
+void tNMEA2000_esp32::RetryFrames()
+{
+    const tCANTxEntry *entry;
+    tCANTxEntry sent;
+    twai_status_info_t status_info;
+    uint32_t retried = 0;
+
+    if (tx_retry.Count() == 0 || twai_get_status_info(&status_info) != ESP_OK)
+        return;
 
-            // Start monitoring alerts again
-            twai_reconfigure_alerts(ALERTS_TO_WATCH, nullptr);
+    // Only try what fits, a full TWAI TX queue is the normal case here
+    uint32_t room = status_info.msgs_to_tx < ESP32_CAN_TX_QUEUE_LEN ? ESP32_CAN_TX_QUEUE_LEN - status_info.msgs_to_tx : 0;
+
+    while (room > 0 && (entry = tx_retry.Front()) != nullptr)
+    {
+#if ESP32_CAN_TX_EXPIRY == 1
+        if (TxExpiresAt(entry->id, entry->enqueued) <= esp_timer_get_time())
+        {
+            tx_retry.Pop(&sent, 1);
+            tx_expired.fetch_add(1, std::memory_order_relaxed);
+            continue;
         }
+#endif
+        if (!TransmitFrame(entry->id, entry->len, entry->data, entry->enqueued))
+            break;
+
+        room--;
+
+        tx_retry.Pop(&sent, 1);
+        retried++;
     }
+
+    tx_queued.fetch_add(retried, std::memory_order_relaxed);
+    tx_retried.fetch_add(retried, std::memory_order_relaxed);
 }
+#endif
 
+#if ESP32_CAN_TX_EXPIRY == 1
+//*****************************************************************************
+int64_t tNMEA2000_esp32::TxExpiresAt(unsigned long id, int64_t enqueued) const
+{
+    uint32_t max_age = tx_max_age_us[tCANTxScheduler::Priority(id)];
+
+    return max_age != 0 ? enqueued + max_age : INT64_MAX;
+}
+
+void tNMEA2000_esp32::SetTxMaxAge(int prio, uint32_t ms)
+{
+    if (prio >= 0 && prio < 8)
+        tx_max_age_us[prio] = ms * 1000;
+}
+#endif
+
+#if ESP32_CAN_TX_RETRY || ESP32_CAN_TX_SHADOW
+//*****************************************************************************
+// Expire and retry queued frames, unless a sender holding tx_queue_lock is doing
+// it already. Called by alert_task.
+void tNMEA2000_esp32::ServiceTxQueue()
+{
+    if (xSemaphoreTake(tx_queue_lock, 0) != pdTRUE)
+        return;
+
+#if ESP32_CAN_TX_SHADOW
+    ExpireTxQueue();
+#endif
+#if ESP32_CAN_TX_RETRY
+    RetryFrames();
+#endif
+    xSemaphoreGive(tx_queue_lock);
+}
+#endif
+
+#if ESP32_CAN_TX_SHADOW
+//*****************************************************************************
+// Clear the TWAI TX queue once a frame in it has expired and queue the frames
+// that have not again, in the same order. Called with tx_queue_lock held, on every
+// send and by alert_task.
+void tNMEA2000_esp32::ExpireTxQueue()
+{
+    twai_status_info_t status_info;
+    tCANTxEntry *entries = tx_scratch;
+
+    if (twai_get_status_info(&status_info) != ESP_OK)
+        return;
+
+    // Drop the frames the controller has sent
+    if (tx_shadow.Count() > status_info.msgs_to_tx)
+        tx_shadow.Pop(entries, tx_shadow.Count() - status_info.msgs_to_tx);
+
+    int64_t now = esp_timer_get_time();
+
+    if (now < tx_shadow_expiry)
+        return;
+
+    uint32_t count = tx_shadow.Pop(entries, TX_SHADOW_SIZE);
+    bool expired = false;
+
+    tx_shadow_expiry = INT64_MAX;
+    for (uint32_t i = 0; i < count; i++)
+        expired |= TxExpiresAt(entries[i].id, entries[i].enqueued) <= now;
+
+    // The earliest expiry belonged to a frame already sent
+    if (!expired)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            tx_shadow.Push(entries[i]);
+            int64_t expires = TxExpiresAt(entries[i].id, entries[i].enqueued);
+            if (expires < tx_shadow_expiry)
+                tx_shadow_expiry = expires;
+        }
+        return;
+    }
+
+    // Clearing keeps the frame the controller is sending, if any. Which frame that is
+    // comes from just before the clear: read after it, a frame finished in between
+    // would look never sent and be queued twice. Frames finished since the scan above
+    // are skipped, so the frame the controller holds is the first one left.
+    if (twai_get_status_info(&status_info) != ESP_OK)
+        status_info.msgs_to_tx = count;
+    twai_clear_transmit_queue();
+
+    uint32_t sent = count > status_info.msgs_to_tx ? count - status_info.msgs_to_tx : 0;
+    uint32_t in_flight = status_info.msgs_to_tx > 0 && sent < count ? 1 : 0;
+
+    entries += sent;
+    count -= sent;
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    // The times of the frames cleared sit behind those of the frames sent and in
+    // flight. Rather than tell them apart, RecordTxCompleted discards all of them.
+    tx_times_drop = tx_times.Count();
+#endif
+
+    tx_purges.fetch_add(1, std::memory_order_relaxed);
+
+    RequeueTxShadow(entries, count, in_flight, now);
+}
+
+//*****************************************************************************
+// Queue the frames of a cleared TWAI TX queue again, but for the first in_flight,
+// which the controller still has, and those expired by now. Every frame kept goes
+// back into the copy. Called with tx_queue_lock held.
+void tNMEA2000_esp32::RequeueTxShadow(const tCANTxEntry *entries, uint32_t count, uint32_t in_flight, int64_t now)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const tCANTxEntry &entry = entries[i];
+        int64_t expires = TxExpiresAt(entry.id, entry.enqueued);
+
+        if (i >= in_flight)
+        {
+            if (expires <= now)
+            {
+                tx_expired.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            // Queued again without TransmitFrame, it was counted the first time
+            twai_message_t message;
+            message.flags = TWAI_MSG_FLAG_EXTD;
+            message.identifier = entry.id;
+            message.data_length_code = entry.len;
+            memcpy(message.data, entry.data, entry.len);
+
+            if (twai_transmit(&message, 0) != ESP_OK)
+                continue;
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+            tx_times.Push(entry.enqueued);
+#endif
+        }
+
+        tx_shadow.Push(entry);
+        if (expires < tx_shadow_expiry)
+            tx_shadow_expiry = expires;
+    }
+}
+#endif
+
+//*****************************************************************************
+bool tNMEA2000_esp32::SetBusOffRecovery(const tBusOffRecovery &recovery)
+{
+    // Recovery empties the TWAI TX queue and nothing else holds frames waiting
+    if (recovery.KeepTxQueue && !ESP32_CAN_TX_KEEP)
+    {
+        ESP_LOGE(TAG, "KeepTxQueue needs ESP32_CAN_TX_EXPIRY, the retry queue or the TX scheduler");
+        return false;
+    }
+
+    bus_off_recovery = recovery;
+    return true;
+}
+
+//*****************************************************************************
+void tNMEA2000_esp32::SetTxDeadline(int prio, uint32_t ms)
+{
+    if (prio >= 0 && prio < 8)
+        tx_deadline_ticks[prio] = pdMS_TO_TICKS(ms);
+}
+
+tNMEA2000_esp32::tTxCompletion tNMEA2000_esp32::GetTxCompletion() const
+{
+    tTxCompletion completion = {};
+
+    completion.Queued = tx_queued.load(std::memory_order_relaxed);
+    completion.TimedOut = tx_timed_out.load(std::memory_order_relaxed);
+    completion.Refused = tx_refused.load(std::memory_order_relaxed);
+    completion.MaxBlockedUs = tx_max_blocked_us.load(std::memory_order_relaxed);
+#if ESP32_CAN_TX_EXPIRY == 1
+    completion.Expired = tx_expired.load(std::memory_order_relaxed);
+#endif
+#if ESP32_CAN_TX_SHADOW
+    completion.Purges = tx_purges.load(std::memory_order_relaxed);
+#endif
+#if ESP32_CAN_TX_RETRY
+    completion.Deferred = tx_deferred.load(std::memory_order_relaxed);
+    completion.Retried = tx_retried.load(std::memory_order_relaxed);
+    completion.Pending = tx_retry.Count();
+#endif
+
+    return completion;
+}
+
+//*****************************************************************************
+bool tNMEA2000_esp32::CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf)
+{
+    // Serve frames from the last drained batch before going back to the driver
+    if (rx_batch_pos == rx_batch_count)
+    {
+        rx_batch_count = CANGetFrames(rx_batch, ESP32_CAN_RX_BATCH_SIZE);
+        rx_batch_pos = 0;
+
+        if (rx_batch_count == 0)
+            return false;
+    }
+
+    const tFrame &frame = rx_batch[rx_batch_pos++];
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1 && ESP32_CAN_RX_TIMESTAMPS == 1
+    latency[LatencyRxQueue].Record(esp_timer_get_time() - frame.timestamp);
+#endif
+
+    id = frame.id;
+    len = frame.len;
+    memcpy(buf, frame.data, frame.len);
+
+    return true;
+}
+
+//*****************************************************************************
+bool tNMEA2000_esp32::CANGetFrame(tFrame &frame)
+{
+    if (rx_batch_pos == rx_batch_count)
+    {
+        rx_batch_count = CANGetFrames(rx_batch, ESP32_CAN_RX_BATCH_SIZE);
+        rx_batch_pos = 0;
+
+        if (rx_batch_count == 0)
+            return false;
+    }
+
+    frame = rx_batch[rx_batch_pos++];
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1 && ESP32_CAN_RX_TIMESTAMPS == 1
+    latency[LatencyRxQueue].Record(esp_timer_get_time() - frame.timestamp);
+#endif
+
+    return true;
+}
+
+//*****************************************************************************
+int tNMEA2000_esp32::CANGetFrames(tFrame *frames, int max_frames)
+{
+    int count = rx_ring_size != 0 ? ReadRxRing(frames, max_frames) : ReadRxQueue(frames, max_frames);
+
+    if (count > 0 && FrameLogging())
+    {
+        for (int i = 0; i < count; i++)
+            LogFrame(CANTraceGetFrame, frames[i].id, frames[i].len);
+    }
+
+    return count;
+}
+
+//*****************************************************************************
+void tNMEA2000_esp32::LogFrame(tCANTraceEvent event, unsigned long id, unsigned char len)
+{
+#if ESP32_CAN_FRAME_LOGGING == 0
+    (void)event;
+    (void)id;
+    (void)len;
+#elif ESP32_CAN_TRACE == 1
+    trace.Record(esp_timer_get_time(), id, len, event);
+#else
+    static const char *const Events[] = {"CANSendFrame", "CANSendFrames", "CANGetFrame"};
+    unsigned char prio, src, dst;
+    unsigned long pgn;
+
+    canIdToN2k(id, prio, pgn, src, dst);
+
+    ESP_LOGI(TAG, "%s Len = %d, Prio = %d, PGN = %ld, Src = %d, Dst = %d", Events[event], len, prio, pgn, src, dst);
+#endif
+}
+
+//*****************************************************************************
+void tNMEA2000_esp32::SetReceivePGNs(const unsigned long *pgns)
+{
+    rx_pgns = pgns;
+
+    if (pgns == nullptr)
+    {
+        sw_filter.Disable();
+        return;
+    }
+
+    sw_filter.Begin();
+    for (; *pgns != 0; pgns++)
+        sw_filter.AcceptPGN(*pgns);
+    sw_filter.Commit();
+}
+
+//*****************************************************************************
+// Take one message off the TWAI RX queue. Returns ESP_ERR_NOT_FOUND for a
+// message the software filters dropped.
+esp_err_t tNMEA2000_esp32::ReceiveFrame(tFrame &frame, TickType_t wait_ticks)
+{
+    twai_message_t message;
+    esp_err_t res;
+
+#if ESP32_CAN_RX_TIMESTAMPS == 1
+    // A frame may have been queued at any time since the queue was last seen empty.
+    // Waiting in slices keeps that recent for the frame the wait ends with, and for
+    // the frames queued behind it while the task was waking up.
+    res = twai_receive(&message, 0);
+    while (res == ESP_ERR_TIMEOUT)
+    {
+        rx_empty_time = esp_timer_get_time();
+        if (wait_ticks == 0)
+            break;
+
+        TickType_t slice = pdMS_TO_TICKS(ESP32_CAN_RX_TIMESTAMP_SLICE_MS);
+        if (slice == 0)
+            slice = 1;
+        if (slice > wait_ticks)
+            slice = wait_ticks;
+
+        res = twai_receive(&message, slice);
+        if (wait_ticks != portMAX_DELAY)
+            wait_ticks -= slice;
+    }
+    int64_t now = esp_timer_get_time();
+#else
+    res = twai_receive(&message, wait_ticks);
+#endif
+
+    if (res != ESP_OK)
+        return res;
+
+    if (!message.extd)
+    {
+        rx_dropped_not_extended.fetch_add(1, std::memory_order_relaxed);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Everything the controller received loads the bus, including what the software filter drops
+    CountFrame(message.identifier, message.data_length_code, message.data, true);
+    if (sw_filter.Check(message.identifier) != tCANSwFilter::Accepted)
+        return ESP_ERR_NOT_FOUND;
+
+    frame.id = message.identifier;
+    frame.len = message.data_length_code > 8 ? 8 : message.data_length_code;
+    memcpy(frame.data, message.data, frame.len);
+
+#if ESP32_CAN_RX_TIMESTAMPS == 1
+    frame.timestamp = now;
+    frame.timestamp_error = (uint32_t)(now - rx_empty_time);
+
+    if (frame.timestamp_error > rx_timestamp_error_max.load(std::memory_order_relaxed))
+        rx_timestamp_error_max.store(frame.timestamp_error, std::memory_order_relaxed);
+#endif
+
+    return ESP_OK;
+}
+
+//*****************************************************************************
+// Statistics and accounting for a frame received or queued for transmission
+void tNMEA2000_esp32::CountFrame(unsigned long id, unsigned char len, const unsigned char *data, bool received)
+{
+#if ESP32_CAN_STATISTICS == 1 || ESP32_CAN_ACCOUNTING == 1 || ESP32_CAN_TX_GOVERNOR == 1
+    if (len > 8)
+        len = 8;
+
+    uint32_t bits = CANFrameBits(id, len, data);
+#endif
+
+#if ESP32_CAN_STATISTICS == 1
+    (received ? RxBits : TxBits).fetch_add(bits, std::memory_order_relaxed);
+    (received ? RxPackets : TxPackets).fetch_add(1, std::memory_order_relaxed);
+#endif
+
+#if ESP32_CAN_ACCOUNTING == 1
+    unsigned char prio, src, dst;
+    unsigned long pgn;
+
+    canIdToN2k(id, prio, pgn, src, dst);
+    traffic.Count(src, pgn, len, bits);
+#endif
+
+#if ESP32_CAN_TX_GOVERNOR == 1
+    tx_governor.Count(bits, esp_timer_get_time());
+#endif
+
+    (void)id;
+    (void)len;
+    (void)data;
+    (void)received;
+}
+
+//*****************************************************************************
+int tNMEA2000_esp32::ReadRxQueue(tFrame *frames, int max_frames)
+{
+    int count = 0;
+
+    // Only the first receive may wait, the rest of the batch is what is already queued
+    TickType_t wait_ticks = receive_wait_ticks;
+
+    while (count < max_frames)
+    {
+        esp_err_t res = ReceiveFrame(frames[count], wait_ticks);
+        wait_ticks = 0;
+
+        if (res == ESP_OK)
+        {
+            count++;
+        }
+        else if (res != ESP_ERR_NOT_FOUND)
+        {
+            if (res != ESP_ERR_TIMEOUT)
+            {
+                ESP_LOGE(TAG, "twai_receive failed: %d", res);
+            }
+            break;
+        }
+    }
+
+    return count;
+}
+
+//*****************************************************************************
+int tNMEA2000_esp32::ReadRxRing(tFrame *frames, int max_frames)
+{
+    int count = rx_ring.Pop(frames, max_frames);
+
+    if (count == 0 && receive_wait_ticks != 0 && xSemaphoreTake(rx_ring_semaphore, receive_wait_ticks) == pdTRUE)
+    {
+        count = rx_ring.Pop(frames, max_frames);
+    }
+
+    return count;
+}
+
+//*****************************************************************************
+[[noreturn]] void tNMEA2000_esp32::rx_task(void *param)
+{
+    tNMEA2000_esp32 *pThis = (tNMEA2000_esp32 *)param;
+    tFrame frame;
+
+    while (true)
+    {
+        // Filtered before the ring, rejected frames take no ring space
+        if (pThis->ReceiveFrame(frame, portMAX_DELAY) != ESP_OK)
+            continue;
+
+        if (!pThis->rx_ring.Push(frame))
+        {
+            pThis->rx_ring_overflows.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        uint32_t fill = pThis->rx_ring.Count();
+        if (fill > pThis->rx_ring_high_water.load(std::memory_order_relaxed))
+            pThis->rx_ring_high_water.store(fill, std::memory_order_relaxed);
+
+        // Wake a CANGetFrame waiting for data. It only waits on an empty ring, so
+        // only the frame that made the ring non-empty has to.
+        if (fill == 1 && pThis->receive_wait_ticks != 0)
+            xSemaphoreGive(pThis->rx_ring_semaphore);
+    }
+}
+
+#if ESP32_CAN_STATISTICS == 1
+void tNMEA2000_esp32::Timer_tick(void *arg)
+{
+    tNMEA2000_esp32 *pThis = (tNMEA2000_esp32 *)arg;
+    tCANStatistics stats;
+
+    // Totals only grow, per second counts are differences (modulo 2^32)
+    uint32_t totals[RATE_COUNT];
+    totals[RATE_RX_PACKETS] = pThis->RxPackets.load(std::memory_order_relaxed);
+    totals[RATE_RX_BITS] = pThis->RxBits.load(std::memory_order_relaxed);
+    totals[RATE_TX_PACKETS] = pThis->TxPackets.load(std::memory_order_relaxed);
+    totals[RATE_TX_BITS] = pThis->TxBits.load(std::memory_order_relaxed);
+    totals[RATE_ALERT_WAKEUPS] = pThis->alert_task_wakeups.load(std::memory_order_relaxed);
+    totals[RATE_RX_RING_OVERFLOWS] = pThis->rx_ring_overflows.load(std::memory_order_relaxed);
+
+    // The controller counters, unchanged since the last tick if the driver is not installed
+    twai_status_info_t status_info;
+    if (twai_get_status_info(&status_info) == ESP_OK)
+    {
+        totals[RATE_TX_FAILED] = status_info.tx_failed_count;
+        totals[RATE_RX_MISSED] = status_info.rx_missed_count;
+        totals[RATE_RX_OVERRUN] = status_info.rx_overrun_count;
+        totals[RATE_ARB_LOST] = status_info.arb_lost_count;
+        totals[RATE_BUS_ERRORS] = status_info.bus_error_count;
+    }
+    else
+    {
+        for (int i = RATE_TX_FAILED; i <= RATE_BUS_ERRORS; i++)
+            totals[i] = pThis->rate_last_totals[i];
+        status_info.tx_error_counter = pThis->last_tx_error_counter;
+        status_info.rx_error_counter = pThis->last_rx_error_counter;
+    }
+
+    for (int i = 0; i < RATE_COUNT; i++)
+    {
+        pThis->rates[i].Update(totals[i] - pThis->rate_last_totals[i]);
+        pThis->rate_last_totals[i] = totals[i];
+    }
+
+    stats.Seconds = ++pThis->statistics_seconds;
+    stats.RxPackets = totals[RATE_RX_PACKETS];
+    stats.RxBits = totals[RATE_RX_BITS];
+    stats.TxPackets = totals[RATE_TX_PACKETS];
+    stats.TxBits = totals[RATE_TX_BITS];
+    stats.AlertWakeups = totals[RATE_ALERT_WAKEUPS];
+    stats.RxPacketsPerSecond = pThis->rates[RATE_RX_PACKETS].Get();
+    stats.RxBitsPerSecond = pThis->rates[RATE_RX_BITS].Get();
+    stats.TxPacketsPerSecond = pThis->rates[RATE_TX_PACKETS].Get();
+    stats.TxBitsPerSecond = pThis->rates[RATE_TX_BITS].Get();
+    stats.AlertWakeupsPerSecond = pThis->rates[RATE_ALERT_WAKEUPS].Get();
+
+    // Own frames are not received back, the bus carries RX plus TX
+    stats.BusLoad.Last1s = (uint32_t)(((uint64_t)stats.RxBitsPerSecond.Last1s + stats.TxBitsPerSecond.Last1s) * 10000 / CAN_BITRATE);
+    stats.BusLoad.Avg10s = (uint32_t)(((uint64_t)stats.RxBitsPerSecond.Avg10s + stats.TxBitsPerSecond.Avg10s) * 10000 / CAN_BITRATE);
+    stats.BusLoad.Avg60s = (uint32_t)(((uint64_t)stats.RxBitsPerSecond.Avg60s + stats.TxBitsPerSecond.Avg60s) * 10000 / CAN_BITRATE);
+
+    stats.TxFailed = totals[RATE_TX_FAILED];
+    stats.RxMissed = totals[RATE_RX_MISSED];
+    stats.RxOverrun = totals[RATE_RX_OVERRUN];
+    stats.ArbLost = totals[RATE_ARB_LOST];
+    stats.BusErrors = totals[RATE_BUS_ERRORS];
+    stats.RxRingOverflows = totals[RATE_RX_RING_OVERFLOWS];
+    stats.TxFailedPerSecond = pThis->rates[RATE_TX_FAILED].Get();
+    stats.RxMissedPerSecond = pThis->rates[RATE_RX_MISSED].Get();
+    stats.RxOverrunPerSecond = pThis->rates[RATE_RX_OVERRUN].Get();
+    stats.ArbLostPerSecond = pThis->rates[RATE_ARB_LOST].Get();
+    stats.BusErrorsPerSecond = pThis->rates[RATE_BUS_ERRORS].Get();
+    stats.RxRingOverflowsPerSecond = pThis->rates[RATE_RX_RING_OVERFLOWS].Get();
+
+    stats.TxErrorCounter = status_info.tx_error_counter;
+    stats.RxErrorCounter = status_info.rx_error_counter;
+    stats.TxErrorSlope = (int32_t)status_info.tx_error_counter - (int32_t)pThis->last_tx_error_counter;
+    stats.RxErrorSlope = (int32_t)status_info.rx_error_counter - (int32_t)pThis->last_rx_error_counter;
+    pThis->last_tx_error_counter = status_info.tx_error_counter;
+    pThis->last_rx_error_counter = status_info.rx_error_counter;
+
+    pThis->statistics.Write(stats);
+
+    pThis->RxPacketsPerSecond = stats.RxPacketsPerSecond.Last1s;
+    pThis->RxBitsPerSeconds = stats.RxBitsPerSecond.Last1s;
+    pThis->TxPacketsPerSecond = stats.TxPacketsPerSecond.Last1s;
+    pThis->TxBitsPerSecond = stats.TxBitsPerSecond.Last1s;
+    pThis->AlertWakeupsPerSecond = stats.AlertWakeupsPerSecond.Last1s;
+}
+#endif
+
+//*****************************************************************************
+void tNMEA2000_esp32::InitCANFrameBuffers()
+{
+    tNMEA2000::InitCANFrameBuffers(); // call main initialization
+}
+
+void tNMEA2000_esp32::canIdToN2k(unsigned long id, unsigned char &prio, unsigned long &pgn, unsigned char &src, unsigned char &dst)
+{
+    unsigned char CanIdPF = (unsigned char)(id >> 16);
+    unsigned char CanIdPS = (unsigned char)(id >> 8);
+    unsigned char CanIdDP = (unsigned char)(id >> 24) & 1;
+
+    src = (unsigned char)id >> 0;
+    prio = (unsigned char)((id >> 26) & 0x7);
+
+    if (CanIdPF < 240)
+    {
+        /* PDU1 format, the PS contains the destination address */
+        dst = CanIdPS;
+        pgn = (((unsigned long)CanIdDP) << 16) | (((unsigned long)CanIdPF) << 8);
+    }
+    else
+    {
+        /* PDU2 format, the destination is implied global and the PGN is extended */
+        dst = 0xff;
+        pgn = (((unsigned long)CanIdDP) << 16) | (((unsigned long)CanIdPF) << 8) | (unsigned long)CanIdPS;
+    }
+}
+
+[[noreturn]] void tNMEA2000_esp32::alert_task(void *param)
+{
+    tNMEA2000_esp32 *pThis = (tNMEA2000_esp32 *)param;
+
+    xSemaphoreTake(pThis->alert_task_semaphore, portMAX_DELAY);
+
+    while (true)
+    {
+        uint32_t alerts;
+        TickType_t wait = portMAX_DELAY;
+
+#if ESP32_CAN_TX_EXPIRY == 1
+        // Frames held back by the bus expire without any alert, so look at them
+        // whenever no alert has come for a while
+        wait = pdMS_TO_TICKS(ESP32_CAN_TX_EXPIRY_CHECK_MS);
+#endif
+
+        // The wait before recovery after bus-off, here so that alerts are still read
+        if (pThis->bus_off_backoff_ticks != 0)
+        {
+            TickType_t waited = xTaskGetTickCount() - pThis->bus_off_backoff_from;
+
+            if (waited >= pThis->bus_off_backoff_ticks)
+            {
+                pThis->bus_off_backoff_ticks = 0;
+                pThis->InitiateRecovery();
+            }
+            else if (pThis->bus_off_backoff_ticks - waited < wait)
+            {
+                wait = pThis->bus_off_backoff_ticks - waited;
+            }
+        }
+
+        esp_err_t read = twai_read_alerts(&alerts, wait);
+
+        if (read != ESP_OK)
+        {
+#if ESP32_CAN_TX_EXPIRY == 1
+            twai_status_info_t status_info;
+
+            if (read == ESP_ERR_TIMEOUT && pThis->driver_state.load(std::memory_order_relaxed) == TWAI_STATE_RUNNING &&
+                twai_get_status_info(&status_info) == ESP_OK && status_info.msgs_to_tx > 0)
+            {
+#if ESP32_CAN_TX_SCHEDULER == 1
+                pThis->FeedTxScheduler();
+#else
+                pThis->ServiceTxQueue();
+#endif
+            }
+#endif
+            continue;
+        }
+
+        pThis->alert_task_wakeups.fetch_add(1, std::memory_order_relaxed);
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+        int64_t woken = esp_timer_get_time();
+#endif
+
+        if (pThis->alerts_callback != nullptr && (alerts & pThis->alerts_callback_mask) != 0)
+        {
+            pThis->alerts_callback(alerts & pThis->alerts_callback_mask, alerts & ERROR_ALERTS_TO_WATCH);
+        }
+
+        if (alerts & TWAI_ALERT_ABOVE_ERR_WARN)
+        {
+            ESP_LOGE(TAG, "One of the error counters have exceeded the error warning limit");
+        }
+        if (alerts & TWAI_ALERT_ERR_PASS)
+        {
+            ESP_LOGE(TAG, "TWAI controller has become error passive");
+        }
+        if (alerts & TWAI_ALERT_BUS_OFF)
+        {
+            pThis->BusOff();
+        }
+        if (alerts & TWAI_ALERT_BUS_RECOVERED)
+        {
+            pThis->BusRecovered();
+        }
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+        if (alerts & TWAI_ALERT_TX_SUCCESS)
+        {
+            pThis->RecordTxCompleted(false);
+        }
+#endif
+#if ESP32_CAN_TX_SCHEDULER == 1
+        if (alerts & (TWAI_ALERT_TX_IDLE | TWAI_ALERT_TX_SUCCESS))
+        {
+            pThis->FeedTxScheduler();
+        }
+#endif
+#if ESP32_CAN_TX_RETRY || ESP32_CAN_TX_SHADOW
+        // Off the bus the TWAI TX queue is empty whatever the copy holds
+        if (pThis->driver_state.load(std::memory_order_relaxed) == TWAI_STATE_RUNNING)
+            pThis->ServiceTxQueue();
+#endif
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+        pThis->latency[LatencyAlert].Record(esp_timer_get_time() - woken);
+#endif
+    }
+}
+
+//*****************************************************************************
+// The controller went bus-off: start recovery, or have alert_task start it once
+// the wait the policy asks for is over. Called by alert_task.
+void tNMEA2000_esp32::BusOff()
+{
+    int64_t now = esp_timer_get_time();
+
+    ESP_LOGE(TAG, "Bus-off condition occurred");
+    driver_state.store(TWAI_STATE_BUS_OFF, std::memory_order_relaxed);
+    bus_offs.fetch_add(1, std::memory_order_relaxed);
+
+    // A bus-off while probing belongs to the outage already going on
+    if (bus_off_since == 0)
+    {
+        if (now - bus_rejoined >= (int64_t)bus_off_recovery.BackoffMaxMs * 1000)
+            bus_off_streak = 0;
+        bus_off_streak++;
+        bus_off_since = now;
+    }
+
+    // Reconfigure alerts to detect bus recovery completion
+    twai_reconfigure_alerts(TWAI_ALERT_BUS_RECOVERED, nullptr);
+
+    StashTxQueue();
+
+    if (bus_off_recovery.Policy != BusOffRecoverImmediately)
+    {
+        uint32_t backoff = bus_off_recovery.BackoffMinMs;
+
+        for (uint32_t i = 1; i < bus_off_streak && backoff < bus_off_recovery.BackoffMaxMs; i++)
+            backoff *= 2;
+        if (backoff > bus_off_recovery.BackoffMaxMs)
+            backoff = bus_off_recovery.BackoffMaxMs;
+
+        bus_off_backoff_ms.store(backoff, std::memory_order_relaxed);
+        ESP_LOGE(TAG, "Bus-off %u in a row, waiting %u ms", (unsigned)bus_off_streak, (unsigned)backoff);
+
+        bus_off_backoff_from = xTaskGetTickCount();
+        bus_off_backoff_ticks = pdMS_TO_TICKS(backoff);
+        if (bus_off_backoff_ticks != 0)
+            return;
+    }
+
+    InitiateRecovery();
+}
+
+//*****************************************************************************
+// Recovery needs 128 occurrences of 11 recessive bits. Called by alert_task.
+void tNMEA2000_esp32::InitiateRecovery()
+{
+    ESP_LOGE(TAG, "Initiate bus recovery");
+    if (twai_initiate_recovery() == ESP_OK)
+    {
+        driver_state.store(TWAI_STATE_RECOVERING, std::memory_order_relaxed);
+    }
+}
+
+//*****************************************************************************
+// Recovery empties the TWAI TX queue. Keep what the controller had not sent to
+// queue it again on rejoining, or drop that and the frames held in software.
+void tNMEA2000_esp32::StashTxQueue()
+{
+    twai_status_info_t status_info;
+    uint32_t waiting = twai_get_status_info(&status_info) == ESP_OK ? status_info.msgs_to_tx : 0;
+    uint32_t flushed = 0;
+
+#if ESP32_CAN_TX_RETRY || ESP32_CAN_TX_SHADOW
+    // Senders only hold it to queue without waiting, so this wait is short even
+    // though the bus is gone
+    xSemaphoreTake(tx_queue_lock, portMAX_DELAY);
+#endif
+
+#if ESP32_CAN_TX_SHADOW
+    // Drop the frames the controller has sent, the rest includes the one it failed on
+    if (tx_shadow.Count() > waiting)
+        tx_shadow.Pop(tx_scratch, tx_shadow.Count() - waiting);
+
+    if (bus_off_recovery.KeepTxQueue)
+        tx_stash_count += tx_shadow.Pop(tx_stash + tx_stash_count, TX_SHADOW_SIZE - tx_stash_count);
+    flushed += tx_shadow.Pop(tx_scratch, TX_SHADOW_SIZE);
+    tx_shadow_expiry = INT64_MAX;
+#else
+    flushed += waiting;
+#endif
+
+#if ESP32_CAN_TX_RETRY
+    if (!bus_off_recovery.KeepTxQueue)
+    {
+        tCANTxEntry entry;
+
+        while (tx_retry.Pop(&entry, 1) == 1)
+            flushed++;
+    }
+#endif
+
+#if ESP32_CAN_TX_RETRY || ESP32_CAN_TX_SHADOW
+    xSemaphoreGive(tx_queue_lock);
+#endif
+
+    if (!bus_off_recovery.KeepTxQueue)
+    {
+#if ESP32_CAN_TX_SCHEDULER == 1
+        xSemaphoreTake(tx_scheduler_lock, portMAX_DELAY);
+        flushed += tx_scheduler.Count();
+        tx_scheduler.Clear();
+        xSemaphoreGive(tx_scheduler_lock);
+#endif
+    }
+
+    if (flushed > 0)
+    {
+        bus_off_flushed.fetch_add(flushed, std::memory_order_relaxed);
+        ESP_LOGE(TAG, "Bus-off dropped %u frames waiting to be sent", (unsigned)flushed);
+    }
+}
+
+//*****************************************************************************
+void tNMEA2000_esp32::BusRecovered()
+{
+    // Bus recovery successful. driver_state stays RECOVERING until RejoinBus, through
+    // the probe if there is one.
+    ESP_LOGI(TAG, "TWAI controller has successfully completed bus recovery");
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    // Recovery emptied the TWAI TX queue
+    RecordTxCompleted(true);
+#endif
+
+    // Start TWAI driver
+    if (twai_start() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start driver");
+        driver_state.store(TWAI_STATE_STOPPED, std::memory_order_relaxed);
+        twai_reconfigure_alerts(AlertsToWatch(), nullptr);
+        return;
+    }
+    ESP_LOGI(TAG, "TWAI Driver started");
+
+    if (bus_off_recovery.Policy == BusOffProbeBeforeRejoin && !ProbeBus())
+        return;
+
+    RejoinBus();
+}
+
+//*****************************************************************************
+// Receive with sending held back until the bus has been free of errors for
+// ProbeMs. Listen-only mode would need the driver reinstalled under the tasks
+// blocked in it, so the controller runs in normal mode and only acknowledges.
+// Returns false when the controller went bus-off again meanwhile.
+bool tNMEA2000_esp32::ProbeBus()
+{
+    TickType_t window = pdMS_TO_TICKS(bus_off_recovery.ProbeMs);
+    TickType_t quiet_since = xTaskGetTickCount();
+
+    ESP_LOGI(TAG, "Probing the bus for %u ms", (unsigned)bus_off_recovery.ProbeMs);
+    twai_reconfigure_alerts(ERROR_ALERTS_TO_WATCH | TWAI_ALERT_BUS_ERROR, nullptr);
+
+    while (true)
+    {
+        TickType_t quiet = xTaskGetTickCount() - quiet_since;
+        uint32_t alerts;
+
+        if (quiet >= window)
+            return true;
+
+        if (twai_read_alerts(&alerts, window - quiet) != ESP_OK)
+            continue;
+
+        alert_task_wakeups.fetch_add(1, std::memory_order_relaxed);
+
+        if (alerts_callback != nullptr && (alerts & alerts_callback_mask) != 0)
+        {
+            alerts_callback(alerts & alerts_callback_mask, alerts & ERROR_ALERTS_TO_WATCH);
+        }
+
+        if (alerts & TWAI_ALERT_BUS_OFF)
+        {
+            BusOff();
+            return false;
+        }
+        if (alerts & TWAI_ALERT_BUS_ERROR)
+        {
+            bus_off_probe_restarts.fetch_add(1, std::memory_order_relaxed);
+            quiet_since = xTaskGetTickCount();
+        }
+    }
+}
+
+//*****************************************************************************
+void tNMEA2000_esp32::RejoinBus()
+{
+    int64_t now = esp_timer_get_time();
+    int64_t downtime = now - bus_off_since;
+
+#if ESP32_CAN_TX_SHADOW
+    // Ahead of anything sent from now on
+    xSemaphoreTake(tx_queue_lock, portMAX_DELAY);
+    RequeueTxShadow(tx_stash, tx_stash_count, 0, now);
+    tx_stash_count = 0;
+    xSemaphoreGive(tx_queue_lock);
+#endif
+
+    driver_state.store(TWAI_STATE_RUNNING, std::memory_order_relaxed);
+
+    // Start monitoring alerts again
+    twai_reconfigure_alerts(AlertsToWatch(), nullptr);
+
+    bus_off_recovery_time.Record(downtime);
+    bus_off_downtime_us += downtime;
+    bus_off_downtime_ms.store((uint32_t)(bus_off_downtime_us / 1000), std::memory_order_relaxed);
+    bus_off_since = 0;
+    bus_rejoined = now;
+
+    ESP_LOGI(TAG, "Back on the bus after %u ms", (unsigned)(downtime / 1000));
+
+#if ESP32_CAN_TX_SCHEDULER == 1
+    // Recovery emptied the TWAI TX queue, frames still scheduled go out now
+    FeedTxScheduler();
+#endif
+}
+
+//*****************************************************************************
+tNMEA2000_esp32::tBusOffMetrics tNMEA2000_esp32::GetBusOffMetrics() const
+{
+    tBusOffMetrics metrics;
+
+    metrics.BusOffs = bus_offs.load(std::memory_order_relaxed);
+    metrics.FlushedFrames = bus_off_flushed.load(std::memory_order_relaxed);
+    metrics.ProbeRestarts = bus_off_probe_restarts.load(std::memory_order_relaxed);
+    metrics.DowntimeMs = bus_off_downtime_ms.load(std::memory_order_relaxed);
+    metrics.LastBackoffMs = bus_off_backoff_ms.load(std::memory_order_relaxed);
+    metrics.Recovery = bus_off_recovery_time.Summary();
+
+    return metrics;
+}
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+//*****************************************************************************
+// Frames have left the TWAI TX queue: as many as the queue is now shorter than
+// the recorded enqueue times. Called by alert_task, the consumer of tx_times.
+void tNMEA2000_esp32::RecordTxCompleted(bool discard)
+{
+    twai_status_info_t status_info;
+    int64_t now = esp_timer_get_time();
+    int64_t times[8];
+
+#if ESP32_CAN_TX_SHADOW
+    xSemaphoreTake(tx_queue_lock, portMAX_DELAY);
+
+    // Times a clear of the TWAI TX queue left out of step go first
+    while (tx_times_drop > 0)
+    {
+        uint32_t count = tx_times.Pop(times, tx_times_drop < 8 ? tx_times_drop : 8);
+        tx_times_drop = count > 0 ? tx_times_drop - count : 0;
+    }
+#endif
+
+    uint32_t pending = tx_times.Count();
+    uint32_t done = 0;
+
+    if (twai_get_status_info(&status_info) == ESP_OK)
+        done = discard ? pending : (pending > status_info.msgs_to_tx ? pending - status_info.msgs_to_tx : 0);
+
+    while (done > 0)
+    {
+        uint32_t count = tx_times.Pop(times, done < 8 ? done : 8);
+
+        if (count == 0)
+            break;
+
+        if (!discard)
+        {
+            for (uint32_t i = 0; i < count; i++)
+                latency[LatencyTxQueue].Record(now - times[i]);
+        }
+        done -= count;
+    }
+
+#if ESP32_CAN_TX_SHADOW
+    xSemaphoreGive(tx_queue_lock);
+#endif
+}
+#endif
+
+//*****************************************************************************
+uint32_t tNMEA2000_esp32::AlertsToWatch() const
+{
+    uint32_t alerts = ERROR_ALERTS_TO_WATCH;
+
+    if (alerts_callback != nullptr)
+        alerts |= alerts_callback_mask;
+
+#if ESP32_CAN_TX_SCHEDULER == 1
+    alerts |= TWAI_ALERT_TX_IDLE | TWAI_ALERT_TX_SUCCESS;
+#endif
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    alerts |= TWAI_ALERT_TX_SUCCESS;
+#endif
+#if ESP32_CAN_TX_RETRY
+    alerts |= TWAI_ALERT_TX_IDLE;
+#endif
+
+    return alerts;
+}
+
+//*****************************************************************************
+void tNMEA2000_esp32::SetAlertsCallback(alerts_cb_t cb, uint32_t mask)
+{
+    alerts_callback_mask = mask;
+    alerts_callback = cb;
+
+    // While recovering alert_task watches for BUS_RECOVERED only and applies the new set afterwards
+    if (IsOpen && driver_state.load(std::memory_order_relaxed) == TWAI_STATE_RUNNING)
+        twai_reconfigure_alerts(AlertsToWatch(), nullptr);
+}
+
+//*****************************************************************************
 void tNMEA2000_esp32::SetLogLevel(esp_log_level_t level)
 {
     esp_log_level_set(TAG, level);
+    frame_logging.store(level >= ESP_LOG_INFO, std::memory_order_relaxed);
 }
\ No newline at end of file
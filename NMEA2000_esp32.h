@@ -38,6 +38,16 @@ before including NMEA2000_esp32.h or NMEA2000_CAN.h
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "driver/twai.h"
+#include "NMEA2000_esp32_accounting.h"
+#include "NMEA2000_esp32_filter.h"
+#include "NMEA2000_esp32_governor.h"
+#include "NMEA2000_esp32_histogram.h"
+#include "NMEA2000_esp32_limiter.h"
+#include "NMEA2000_esp32_ring.h"
+#include "NMEA2000_esp32_scheduler.h"
+#include "NMEA2000_esp32_stats.h"
+#include "NMEA2000_esp32_trace.h"
+#include <atomic>
 
 #ifndef ESP32_CAN_TX_PIN
 #define ESP32_CAN_TX_PIN GPIO_NUM_16
@@ -49,30 +59,419 @@ before including NMEA2000_esp32.h or NMEA2000_CAN.h
 #define ESP32_CAN_RX_TICKS_WAIT 0
 #endif
 
+// Sniffer build: the controller runs in TWAI listen-only mode, so it neither
+// acknowledges nor sends, and accepts every frame whatever SetReceivePGNs says.
+// The defaults below are then tuned for capture: a long TWAI RX queue drained by
+// the RX task into a large ring, receive timestamps and no per-frame logging.
+// Put the NMEA2000 library in N2km_ListenOnly mode too, CANSendFrame fails.
+#ifndef ESP32_CAN_LISTEN_ONLY
+#define ESP32_CAN_LISTEN_ONLY 0
+#endif
+#if ESP32_CAN_LISTEN_ONLY == 1
+#ifndef ESP32_CAN_RX_QUEUE_LEN
+#define ESP32_CAN_RX_QUEUE_LEN 128
+#endif
+#ifndef ESP32_CAN_RX_RING_SIZE
+#define ESP32_CAN_RX_RING_SIZE 512
+#endif
+#ifndef ESP32_CAN_RX_TIMESTAMPS
+#define ESP32_CAN_RX_TIMESTAMPS 1
+#endif
+#ifndef ESP32_CAN_FRAME_LOGGING
+#define ESP32_CAN_FRAME_LOGGING 0
+#endif
+#endif
+
 #ifndef ESP32_CAN_STATISTICS
 #define ESP32_CAN_STATISTICS 0
 #endif
 
+#ifndef ESP32_CAN_RX_QUEUE_LEN
+#define ESP32_CAN_RX_QUEUE_LEN 32
+#endif
+#ifndef ESP32_CAN_TX_QUEUE_LEN
+#define ESP32_CAN_TX_QUEUE_LEN 32
+#endif
+
+// Number of frames CANGetFrame drains from the TWAI RX queue in one go
+#ifndef ESP32_CAN_RX_BATCH_SIZE
+#define ESP32_CAN_RX_BATCH_SIZE 32
+#endif
+
+// Frames buffered between the RX task and CANGetFrame, a power of two. 0 disables
+// the RX task and CANGetFrame reads the TWAI RX queue directly.
+#ifndef ESP32_CAN_RX_RING_SIZE
+#define ESP32_CAN_RX_RING_SIZE 0
+#endif
+#ifndef ESP32_CAN_RX_RING_IN_PSRAM
+#define ESP32_CAN_RX_RING_IN_PSRAM 0
+#endif
+#ifndef ESP32_CAN_RX_TASK_PRIO
+#define ESP32_CAN_RX_TASK_PRIO 12
+#endif
+#ifndef ESP32_CAN_RX_TASK_CORE
+#define ESP32_CAN_RX_TASK_CORE tskNO_AFFINITY
+#endif
+
+// Send through per-priority software queues instead of straight into the FIFO TWAI
+// TX queue, see NMEA2000_esp32_scheduler.h
+#ifndef ESP32_CAN_TX_SCHEDULER
+#define ESP32_CAN_TX_SCHEDULER 0
+#endif
+// Frames the scheduler keeps in the TWAI TX queue, including the one on the bus. 1
+// gives strict priority order, 2 keeps the bus busy while alert_task refills.
+#ifndef ESP32_CAN_TX_SCHEDULER_HW_DEPTH
+#define ESP32_CAN_TX_SCHEDULER_HW_DEPTH 1
+#endif
+
+// Longest a send with wait_sent waits for room in the TWAI TX queue, can be set per
+// priority with SetTxDeadline
+#ifndef ESP32_CAN_TX_DEADLINE_MS
+#define ESP32_CAN_TX_DEADLINE_MS 100
+#endif
+// Frames kept for a later retry when they miss their deadline or find the TWAI TX
+// queue full, a power of two. 0 fails those sends and the NMEA2000 library retries
+// them. Not used with the TX scheduler, which never waits.
+#ifndef ESP32_CAN_TX_RETRY_QUEUE_LEN
+#define ESP32_CAN_TX_RETRY_QUEUE_LEN 0
+#endif
+#define ESP32_CAN_TX_RETRY (ESP32_CAN_TX_RETRY_QUEUE_LEN > 0 && ESP32_CAN_TX_SCHEDULER == 0)
+
+// Drop frames that waited longer than their priority's maximum age (SetTxMaxAge) in
+// the TX scheduler, the retry queue or the TWAI TX queue. The TWAI TX queue cannot
+// be edited, so it is cleared and the frames still fresh are queued again.
+#ifndef ESP32_CAN_TX_EXPIRY
+#define ESP32_CAN_TX_EXPIRY 0
+#endif
+#ifndef ESP32_CAN_TX_MAX_AGE_MS
+#define ESP32_CAN_TX_MAX_AGE_MS 1000
+#endif
+// No alert comes while the bus holds queued frames back, so alert_task checks the
+// TWAI TX queue whenever it has had no alert for this long
+#ifndef ESP32_CAN_TX_EXPIRY_CHECK_MS
+#define ESP32_CAN_TX_EXPIRY_CHECK_MS 100
+#endif
+// The scheduler keeps the TWAI TX queue short, only without it is a copy kept
+#define ESP32_CAN_TX_SHADOW (ESP32_CAN_TX_EXPIRY == 1 && ESP32_CAN_TX_SCHEDULER == 0)
+
+// Latency histograms of the send, TX queue, RX queue and alert paths, see GetLatency
+#ifndef ESP32_CAN_LATENCY_HISTOGRAMS
+#define ESP32_CAN_LATENCY_HISTOGRAMS 0
+#endif
+
+// Without the scheduler, sends queue under tx_queue_lock, so that a message finds
+// room for all of its frames or none whatever other tasks send, and the retry
+// queue, the TWAI TX queue copy and the times its frames were queued stay in step
+#define ESP32_CAN_TX_LOCK (ESP32_CAN_TX_SCHEDULER == 0)
+
+// Whether bus-off recovery can keep frames waiting to be sent, see KeepTxQueue
+#define ESP32_CAN_TX_KEEP (ESP32_CAN_TX_RETRY || ESP32_CAN_TX_SHADOW || ESP32_CAN_TX_SCHEDULER == 1)
+
+// Stamp received frames with the time they leave the TWAI RX queue, see tFrame.
+// The RX queue histogram needs them.
+#ifndef ESP32_CAN_RX_TIMESTAMPS
+#define ESP32_CAN_RX_TIMESTAMPS ESP32_CAN_LATENCY_HISTOGRAMS
+#endif
+// A receive that waits looks at the TWAI RX queue again this often, so that a
+// frame it wakes for has a bound that includes the time the task took to wake
+#ifndef ESP32_CAN_RX_TIMESTAMP_SLICE_MS
+#define ESP32_CAN_RX_TIMESTAMP_SLICE_MS 10
+#endif
+
+// Count frames, bytes and bits per source address and per PGN, see
+// NMEA2000_esp32_accounting.h
+#ifndef ESP32_CAN_ACCOUNTING
+#define ESP32_CAN_ACCOUNTING 0
+#endif
+
+// Token bucket limits per PGN on CANSendFrame and CANSendFrames, see
+// NMEA2000_esp32_limiter.h and GetTxLimiter
+#ifndef ESP32_CAN_TX_LIMITER
+#define ESP32_CAN_TX_LIMITER 0
+#endif
+
+// Throttle low priority frames while the bus load is above a target, see
+// NMEA2000_esp32_governor.h and GetTxGovernor
+#ifndef ESP32_CAN_TX_GOVERNOR
+#define ESP32_CAN_TX_GOVERNOR 0
+#endif
+
+// 0 removes the per-frame INFO log lines, and their trace records, from the build
+#ifndef ESP32_CAN_FRAME_LOGGING
+#define ESP32_CAN_FRAME_LOGGING 1
+#endif
+
+// Record the per-frame INFO log lines as binary records instead of formatting them,
+// see NMEA2000_esp32_trace.h and ReadTrace
+#ifndef ESP32_CAN_TRACE
+#define ESP32_CAN_TRACE 0
+#endif
+
+// Bus-off recovery waits, see SetBusOffRecovery
+#ifndef ESP32_CAN_BUS_OFF_BACKOFF_MIN_MS
+#define ESP32_CAN_BUS_OFF_BACKOFF_MIN_MS 100
+#endif
+#ifndef ESP32_CAN_BUS_OFF_BACKOFF_MAX_MS
+#define ESP32_CAN_BUS_OFF_BACKOFF_MAX_MS 5000
+#endif
+#ifndef ESP32_CAN_BUS_OFF_PROBE_MS
+#define ESP32_CAN_BUS_OFF_PROBE_MS 500
+#endif
+
 //#define ESP32_CAN_ISR_IN_IRAM
 
 typedef void (*alerts_cb_t)(uint32_t alerts, bool is_error);
 
 class tNMEA2000_esp32 : public tNMEA2000
 {
+  public:
+    struct tFrame
+    {
+        unsigned long id;
+        unsigned char len;
+        unsigned char data[8];
+#if ESP32_CAN_RX_TIMESTAMPS == 1
+        // Received frames only: esp_timer_get_time() when the frame was taken off the
+        // TWAI RX queue. It reached the queue at most timestamp_error us before that,
+        // the time since the queue was last seen empty, which is at most
+        // ESP32_CAN_RX_TIMESTAMP_SLICE_MS for a frame the receive waited for.
+        int64_t timestamp;
+        uint32_t timestamp_error;
+#endif
+    };
+
+    // What became of the frames sent, see GetTxCompletion
+    struct tTxCompletion
+    {
+        uint32_t Queued;       // Frames put in the TWAI TX queue
+        uint32_t TimedOut;     // Sends that waited their deadline out
+        uint32_t Deferred;     // Frames put in the retry queue
+        uint32_t Retried;      // Frames moved from the retry queue to the TWAI TX queue
+        uint32_t Refused;      // Frames failed back to the caller for lack of room
+        uint32_t Pending;      // Frames in the retry queue now
+        uint32_t MaxBlockedUs; // Longest wait for room in the TWAI TX queue
+        uint32_t Expired;      // Frames dropped for waiting longer than their maximum age
+        uint32_t Purges;       // Times the TWAI TX queue was cleared of expired frames
+    };
+
+    enum tBusOffPolicy
+    {
+        BusOffRecoverImmediately, // Start recovery as soon as the controller goes bus-off
+        BusOffRecoverWithBackoff, // Wait before starting recovery
+        BusOffProbeBeforeRejoin   // Wait, recover, then receive only until the bus is free of errors.
+                                  // GetDriverState gives TWAI_STATE_RECOVERING until then.
+    };
+
+    // How alert_task gets the node back on the bus after bus-off, see SetBusOffRecovery
+    struct tBusOffRecovery
+    {
+        tBusOffPolicy Policy;
+        // The wait before recovery starts doubles from BackoffMinMs for each bus-off
+        // less than BackoffMaxMs after the node rejoined, up to BackoffMaxMs
+        uint32_t BackoffMinMs;
+        uint32_t BackoffMaxMs;
+        // Error free receive time needed before sending again with BusOffProbeBeforeRejoin
+        uint32_t ProbeMs;
+        // Send the frames waiting at bus-off after rejoining, or drop them. Recovery
+        // always empties the TWAI TX queue; only with ESP32_CAN_TX_EXPIRY is a copy
+        // of it kept. The retry queue and the TX scheduler are kept whole. Without
+        // any of them there is nothing to keep and SetBusOffRecovery refuses it.
+        bool KeepTxQueue;
+    };
+
+    // Bus-off history, see GetBusOffMetrics
+    struct tBusOffMetrics
+    {
+        uint32_t BusOffs;         // Times the controller went bus-off
+        uint32_t FlushedFrames;   // Frames waiting to be sent that bus-off recovery dropped
+        uint32_t ProbeRestarts;   // Probes started over because of a bus error
+        uint32_t DowntimeMs;      // Total time from bus-off to rejoining, of the outages over
+        uint32_t LastBackoffMs;   // Wait before the last recovery
+        tLatencySummary Recovery; // Time from bus-off to rejoining in us, up to 16.7 s
+    };
+
+    enum tLatencyPath
+    {
+        LatencySend,    // Time spent in CANSendFrame
+        LatencyTxQueue, // From queueing a frame in the TWAI TX queue to alert_task seeing it sent
+        LatencyRxQueue, // From taking a frame off the TWAI RX queue to CANGetFrame returning it
+        LatencyAlert,   // From alert_task waking to having handled the alerts
+        LatencyPathCount
+    };
+
   private:
     bool IsOpen;
     static bool CanInUse;
 
 #if ESP32_CAN_STATISTICS == 1
-    unsigned int RxBits = 0;
-    unsigned int RxPackets = 0;
-
-    unsigned int TxBits = 0;
-    unsigned int TxPackets = 0;
+    // Running totals, added to by the send and receive paths and sampled by Timer_tick
+    std::atomic<uint32_t> RxBits{0};
+    std::atomic<uint32_t> RxPackets{0};
+
+    std::atomic<uint32_t> TxBits{0};
+    std::atomic<uint32_t> TxPackets{0};
+
+    // Owned by Timer_tick
+    enum
+    {
+        RATE_RX_PACKETS,
+        RATE_RX_BITS,
+        RATE_TX_PACKETS,
+        RATE_TX_BITS,
+        RATE_ALERT_WAKEUPS,
+        RATE_TX_FAILED,
+        RATE_RX_MISSED,
+        RATE_RX_OVERRUN,
+        RATE_ARB_LOST,
+        RATE_BUS_ERRORS,
+        RATE_RX_RING_OVERFLOWS,
+        RATE_COUNT
+    };
+    uint32_t rate_last_totals[RATE_COUNT] = {};
+    tCANRateAverage rates[RATE_COUNT];
+    uint32_t statistics_seconds = 0;
+    uint32_t last_tx_error_counter = 0;
+    uint32_t last_rx_error_counter = 0;
+
+    tSeqLock<tCANStatistics> statistics;
 
     static void Timer_tick(void *arg);
 #endif
 
+    // Maintained by alert_task so that the transmit path does not need twai_get_status_info
+    std::atomic<twai_state_t> driver_state{TWAI_STATE_STOPPED};
+    std::atomic<uint32_t> tx_rejected_not_running{0};
+
+    // Owned by alert_task
+    tBusOffRecovery bus_off_recovery = {BusOffRecoverImmediately, ESP32_CAN_BUS_OFF_BACKOFF_MIN_MS, ESP32_CAN_BUS_OFF_BACKOFF_MAX_MS,
+                                        ESP32_CAN_BUS_OFF_PROBE_MS, ESP32_CAN_TX_KEEP};
+    int64_t bus_off_since = 0;   // Start of the outage, 0 while on the bus
+    int64_t bus_rejoined = 0;    // End of the last outage
+    uint32_t bus_off_streak = 0; // Bus-offs in a row, each soon after rejoining
+    TickType_t bus_off_backoff_from = 0;
+    TickType_t bus_off_backoff_ticks = 0; // Wait before recovery going on, 0 for none
+    uint64_t bus_off_downtime_us = 0;
+
+    std::atomic<uint32_t> bus_offs{0};
+    std::atomic<uint32_t> bus_off_flushed{0};
+    std::atomic<uint32_t> bus_off_probe_restarts{0};
+    std::atomic<uint32_t> bus_off_downtime_ms{0};
+    std::atomic<uint32_t> bus_off_backoff_ms{0};
+    tLatencyHistogram bus_off_recovery_time;
+
+    TickType_t tx_deadline_ticks[8];
+    std::atomic<uint32_t> tx_queued{0};
+    std::atomic<uint32_t> tx_timed_out{0};
+    std::atomic<uint32_t> tx_refused{0};
+    std::atomic<uint32_t> tx_max_blocked_us{0};
+
+    // Frames the driver holds at most: the TWAI TX queue plus the frame in the controller
+    static const uint32_t TX_DRIVER_FRAMES = ESP32_CAN_TX_QUEUE_LEN + 1;
+
+#if ESP32_CAN_TX_LOCK
+    // Guards the retry queue, the TWAI TX queue copy and the pushes to tx_times.
+    // Never held across a wait, so that alert_task can always take it.
+    SemaphoreHandle_t tx_queue_lock;
+#endif
+
+#if ESP32_CAN_TX_RETRY
+    // Frames waiting for room in the TWAI TX queue, oldest first. New frames go
+    // behind them to keep the order of fast packet frames.
+    tCANTxEntry tx_retry_storage[ESP32_CAN_TX_RETRY_QUEUE_LEN];
+    tSpscRingBuffer<tCANTxEntry> tx_retry;
+    std::atomic<uint32_t> tx_deferred{0};
+    std::atomic<uint32_t> tx_retried{0};
+#endif
+
+#if ESP32_CAN_TX_EXPIRY == 1
+    uint32_t tx_max_age_us[8];
+    std::atomic<uint32_t> tx_expired{0};
+#endif
+
+#if ESP32_CAN_TX_SHADOW
+    static const uint32_t TX_SHADOW_SIZE = SpscRingSizeFor(TX_DRIVER_FRAMES);
+
+    // Copy of the frames in the TWAI TX queue, oldest first, to queue again what is
+    // still fresh after clearing it. Frames the controller has sent are dropped as
+    // msgs_to_tx falls.
+    tCANTxEntry tx_shadow_storage[TX_SHADOW_SIZE];
+    tSpscRingBuffer<tCANTxEntry> tx_shadow;
+    int64_t tx_shadow_expiry = INT64_MAX; // No frame in the copy expires before this
+    std::atomic<uint32_t> tx_purges{0};
+
+    // The copy as it was at bus-off, queued again by alert_task on rejoining
+    tCANTxEntry tx_stash[TX_SHADOW_SIZE];
+    uint32_t tx_stash_count = 0;
+
+    // Working space for ExpireTxQueue and StashTxQueue, guarded by tx_queue_lock,
+    // kept off the stack of alert_task
+    tCANTxEntry tx_scratch[TX_SHADOW_SIZE];
+#endif
+
+    // Log level of TAG is INFO or above, as last set through SetLogLevel. Saves an
+    // esp_log_level_get per frame, which takes the log tag cache lock.
+    std::atomic<bool> frame_logging{false};
+
+    tFrame rx_batch[ESP32_CAN_RX_BATCH_SIZE];
+    int rx_batch_count = 0;
+    int rx_batch_pos = 0;
+
+    uint32_t rx_ring_size = ESP32_CAN_RX_RING_SIZE;
+    bool rx_ring_in_psram = ESP32_CAN_RX_RING_IN_PSRAM;
+    tSpscRingBuffer<tFrame> rx_ring;
+    SemaphoreHandle_t rx_ring_semaphore = nullptr;
+    std::atomic<uint32_t> rx_ring_overflows{0};
+    std::atomic<uint32_t> rx_ring_high_water{0};
+
+    const unsigned long *rx_pgns = nullptr;
+    tCANHwFilter hw_filter = {TWAI_FILTER_CONFIG_ACCEPT_ALL(), 1UL << 18, 1UL << 18, 0};
+    tCANSwFilter sw_filter;
+    std::atomic<uint32_t> rx_dropped_not_extended{0};
+
+#if ESP32_CAN_RX_TIMESTAMPS == 1
+    int64_t rx_empty_time = 0; // When the TWAI RX queue was last seen empty, by the receiving task
+    std::atomic<uint32_t> rx_timestamp_error_max{0};
+#endif
+
+#if ESP32_CAN_ACCOUNTING == 1
+    tCANTrafficAccounting traffic;
+#endif
+
+#if ESP32_CAN_TRACE == 1
+    tCANTrace trace;
+#endif
+
+#if ESP32_CAN_TX_LIMITER == 1
+    tCANTxLimiter tx_limiter;
+#endif
+
+#if ESP32_CAN_TX_GOVERNOR == 1
+    tCANTxGovernor tx_governor;
+#endif
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    static const uint32_t TX_TIMES_SIZE = SpscRingSizeFor(TX_DRIVER_FRAMES);
+
+    tLatencyHistogram latency[LatencyPathCount];
+
+    // When each frame in the TWAI TX queue was queued, oldest first. Pushed after
+    // twai_transmit under tx_queue_lock, or tx_scheduler_lock with the scheduler,
+    // which then queues every frame, and popped by alert_task as msgs_to_tx drops.
+    int64_t tx_times_storage[TX_TIMES_SIZE];
+    tSpscRingBuffer<int64_t> tx_times;
+#if ESP32_CAN_TX_SHADOW
+    // Times at the front of tx_times that RecordTxCompleted discards, as a clear of
+    // the TWAI TX queue left them out of step. Guarded by tx_queue_lock.
+    uint32_t tx_times_drop = 0;
+#endif
+#endif
+
+#if ESP32_CAN_TX_SCHEDULER == 1
+    tCANTxScheduler tx_scheduler;
+    SemaphoreHandle_t tx_scheduler_lock;
+    const unsigned long *tx_replace_pgns = nullptr;
+#endif
+
   protected:
     gpio_num_t TxPin;
     gpio_num_t RxPin;
@@ -83,37 +482,222 @@ class tNMEA2000_esp32 : public tNMEA2000
 
     SemaphoreHandle_t alert_task_semaphore;
     alerts_cb_t alerts_callback = nullptr;
+    uint32_t alerts_callback_mask = 0;
+    std::atomic<uint32_t> alert_task_wakeups{0};
 
     static const int ERROR_ALERTS_TO_WATCH = TWAI_ALERT_ABOVE_ERR_WARN | TWAI_ALERT_ERR_PASS | TWAI_ALERT_BUS_OFF | TWAI_ALERT_RX_FIFO_OVERRUN;
     static const int DATA_EVENTS_TO_WATCH = TWAI_ALERT_TX_IDLE | TWAI_ALERT_TX_SUCCESS | TWAI_ALERT_RX_DATA;
     static const int ALERTS_TO_WATCH = ERROR_ALERTS_TO_WATCH | DATA_EVENTS_TO_WATCH;
 
 #if ESP32_CAN_STATISTICS == 1
+    // Rates of the last second, kept for derived classes. GetStatistics is consistent
+    // and can be read from any task.
     unsigned int RxBitsPerSeconds = 0;
     unsigned int RxPacketsPerSecond = 0;
 
     unsigned int TxBitsPerSecond = 0;
     unsigned int TxPacketsPerSecond = 0;
+
+    unsigned int AlertWakeupsPerSecond = 0;
 #endif
 
   protected:
     void CAN_init();
 
+    // Alerts alert_task has to wake for: the error alerts it handles itself and
+    // whatever the callback and the TX scheduler consume
+    uint32_t AlertsToWatch() const;
+
   public:
     tNMEA2000_esp32(gpio_num_t _TxPin = ESP32_CAN_TX_PIN, gpio_num_t _RxPin = ESP32_CAN_RX_PIN, TickType_t rxWaitTicks = ESP32_CAN_RX_TICKS_WAIT);
 
     bool CANSendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent = true);
+
+    // Queue all frames of a multi-frame message, e.g. a fast packet, as a unit: nothing
+    // is queued unless the TX queue has room for every frame. With wait_sent the send
+    // waits up to its deadline for that room.
+    bool CANSendFrames(const tFrame *frames, int count, bool wait_sent = true);
+
     bool CANOpen();
     bool CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf);
+    // The same, with the receive timestamp when ESP32_CAN_RX_TIMESTAMPS is 1
+    bool CANGetFrame(tFrame &frame);
+
+    // Drain up to max_frames extended frames from the TWAI RX queue, or the RX ring when
+    // the RX task is enabled. Only the first receive waits (rxWaitTicks), returns the
+    // number of frames stored in frames.
+    int CANGetFrames(tFrame *frames, int max_frames);
+
+    // Receive through a dedicated RX task that moves frames from the TWAI RX queue into
+    // a ring of ring_size frames (a power of two) as soon as they arrive, so that a slow
+    // application loop does not overrun the driver queue. Call before CANOpen.
+    void EnableRxTask(uint32_t ring_size, bool in_psram = ESP32_CAN_RX_RING_IN_PSRAM)
+    {
+        rx_ring_size = ring_size;
+        rx_ring_in_psram = in_psram;
+    }
+    // Receive only these PGNs (a zero terminated list, e.g. the one given to
+    // ExtendReceiveMessages) and the mandatory ISO PGNs. The TWAI acceptance filter is
+    // programmed from the list at CANOpen, so the list must stay valid, and the software
+    // filter drops what the controller lets through for other PGNs. Calling it again
+    // after CANOpen rebuilds the software filter only, nullptr disables it.
+    void SetReceivePGNs(const unsigned long *pgns);
+    // The filter in use and its estimated false-accept ratio, valid after CANOpen
+    const tCANHwFilter &GetHwFilter() const { return hw_filter; }
+    // The software filter, e.g. to reject sources or rebuild the PGN table with
+    // Begin/AcceptPGN/Commit. Its counters give the frames dropped by PGN and by source.
+    tCANSwFilter &GetSwFilter() { return sw_filter; }
+    // Standard (11 bit) frames dropped, NMEA 2000 only uses extended frames. Frames the
+    // acceptance filter drops never reach the driver and are not counted.
+    uint32_t GetRxDroppedNotExtended() const { return rx_dropped_not_extended.load(std::memory_order_relaxed); }
+
+    // Frames lost because the ring was full, and the highest ring fill seen
+    uint32_t GetRxRingOverflows() const { return rx_ring_overflows.load(std::memory_order_relaxed); }
+    uint32_t GetRxRingHighWater() const { return rx_ring_high_water.load(std::memory_order_relaxed); }
+
+#if ESP32_CAN_RX_TIMESTAMPS == 1
+    // Largest timestamp_error seen. It grows when frames wait in the TWAI RX queue,
+    // i.e. when the RX task or the application loop falls behind the bus.
+    uint32_t GetRxTimestampErrorMax() const { return rx_timestamp_error_max.load(std::memory_order_relaxed); }
+#endif
 
     virtual void InitCANFrameBuffers();
 
-    void SetAlertsCallback(alerts_cb_t cb) {alerts_callback = cb;};
+    // Call cb from alert_task for the alerts in mask. Data events (RX_DATA, TX_SUCCESS,
+    // TX_IDLE) wake alert_task for about every frame on the bus, leave them out of mask
+    // unless the callback needs them.
+    void SetAlertsCallback(alerts_cb_t cb, uint32_t mask = ALERTS_TO_WATCH);
+    // Times alert_task was woken by the driver
+    uint32_t GetAlertTaskWakeups() const { return alert_task_wakeups.load(std::memory_order_relaxed); }
+
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    // p50/p99/p99.9/max of one path in microseconds. Recording is lock-free and cheap,
+    // reading can be done from any task while frames flow.
+    tLatencySummary GetLatency(tLatencyPath path) const { return latency[path].Summary(); }
+#endif
+
+#if ESP32_CAN_ACCOUNTING == 1
+    // Received and sent traffic per source and PGN, e.g. GetTraffic().TopPGNs(top, 10)
+    const tCANTrafficAccounting &GetTraffic() const { return traffic; }
+#endif
+
+#if ESP32_CAN_TX_LIMITER == 1
+    // Rate limits on sent frames, e.g. GetTxLimiter().AddRule(129025, 10, 5,
+    // tCANTxLimiter::Drop), and what they passed, dropped, deferred and found
+    // longer than a burst
+    tCANTxLimiter &GetTxLimiter() { return tx_limiter; }
+#endif
+
+#if ESP32_CAN_TX_GOVERNOR == 1
+    // Bus load governor, e.g. GetTxGovernor().Configure(6000, 5000, 6,
+    // tCANTxGovernor::Defer), with the live load and its decisions
+    tCANTxGovernor &GetTxGovernor() { return tx_governor; }
+#endif
+
+#if ESP32_CAN_TRACE == 1
+    // Oldest unread trace records, written while the log level is INFO or above. Call
+    // from one task, and often enough that the ring does not overwrite them.
+    uint32_t ReadTrace(tCANTraceRecord *records, uint32_t max) { return trace.Read(records, max); }
+    uint32_t GetTraceLost() const { return trace.GetLost(); }
+#endif
+
+#if ESP32_CAN_STATISTICS == 1
+    // Traffic, bus load, controller errors and frame loss as of the last one second
+    // tick, with 1 s / 10 s / 60 s rates. Read without locks from any task or core.
+    tCANStatistics GetStatistics() const { return statistics.Read(); }
+#endif
 
+    // Also enables the per-frame INFO lines from INFO up. Set the level of the
+    // NMEA2000_esp32 tag here rather than with esp_log_level_set.
     void SetLogLevel(esp_log_level_t level);
 
+    // Longest CANSendFrame and CANSendFrames with wait_sent wait for room in the TWAI
+    // TX queue for frames of priority prio (0-7)
+    void SetTxDeadline(int prio, uint32_t ms);
+#if ESP32_CAN_TX_EXPIRY == 1
+    // Frames of priority prio (0-7) not on the bus within ms of being sent are
+    // dropped, 0 keeps them until sent
+    void SetTxMaxAge(int prio, uint32_t ms);
+#endif
+    tTxCompletion GetTxCompletion() const;
+
+    // Recovery policy for bus-off, call before CANOpen. The default recovers at once
+    // and keeps the frames waiting, where the build can. False, with the policy left
+    // as it was, for KeepTxQueue in a build with nothing to keep.
+    bool SetBusOffRecovery(const tBusOffRecovery &recovery);
+    tBusOffMetrics GetBusOffMetrics() const;
+
+    twai_state_t GetDriverState() const { return driver_state.load(std::memory_order_relaxed); }
+    // Frames refused because the driver was not running (bus-off, recovering or stopped)
+    uint32_t GetTxRejectedNotRunning() const { return tx_rejected_not_running.load(std::memory_order_relaxed); }
+
+#if ESP32_CAN_TX_SCHEDULER == 1
+    // Head-of-line latency of one priority class (0-7), frames waiting in the scheduler
+    // and frames refused because their priority queue was full
+    tCANTxScheduler::tLatency GetTxLatency(int prio);
+    uint32_t GetTxScheduled();
+    uint32_t GetTxSchedulerOverflows();
+
+    // Latest-value sending for these PGNs (a zero terminated list that must stay
+    // valid, nullptr for none): CANSendFrame overwrites a frame with the same CAN id
+    // still waiting in the scheduler instead of queueing another one. Only for single
+    // frame PGNs, e.g. 129025, 127250 and 127245, as fast packet frames share one id.
+    void SetTxReplacePGNs(const unsigned long *pgns) { tx_replace_pgns = pgns; }
+    // Frames that overwrote a waiting frame
+    uint32_t GetTxReplaced();
+#endif
+
   private:
+    bool SendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent);
+    bool TransmitFrame(unsigned long id, unsigned char len, const unsigned char *buf, int64_t enqueued = 0);
+    bool TransmitOrDefer(const tFrame *frames, int count, TickType_t wait_ticks);
+#if ESP32_CAN_TX_RETRY
+    bool DeferFrames(const tFrame *frames, int count);
+    void RetryFrames();
+#endif
+#if ESP32_CAN_TX_RETRY || ESP32_CAN_TX_SHADOW
+    void ServiceTxQueue();
+#endif
+#if ESP32_CAN_TX_EXPIRY == 1
+    int64_t TxExpiresAt(unsigned long id, int64_t enqueued) const;
+#endif
+#if ESP32_CAN_TX_SHADOW
+    void ExpireTxQueue();
+    void RequeueTxShadow(const tCANTxEntry *entries, uint32_t count, uint32_t in_flight, int64_t now);
+#endif
+
+    void BusOff();
+    void InitiateRecovery();
+    void BusRecovered();
+    bool ProbeBus();
+    void RejoinBus();
+    void StashTxQueue();
+
+#if ESP32_CAN_TX_SCHEDULER == 1
+    bool ScheduleFrames(const tFrame *frames, int count, bool replace = false);
+    bool IsTxReplacePGN(unsigned long id) const;
+    void FeedTxScheduler();
+#endif
+
+    esp_err_t ReceiveFrame(tFrame &frame, TickType_t wait_ticks);
+    int ReadRxQueue(tFrame *frames, int max_frames);
+    void CountFrame(unsigned long id, unsigned char len, const unsigned char *data, bool received);
+#if ESP32_CAN_LATENCY_HISTOGRAMS == 1
+    void RecordTxCompleted(bool discard);
+#endif
+    int ReadRxRing(tFrame *frames, int max_frames);
+    bool FrameLogging() const
+    {
+#if ESP32_CAN_FRAME_LOGGING == 1
+        return frame_logging.load(std::memory_order_relaxed);
+#else
+        return false;
+#endif
+    }
+    void LogFrame(tCANTraceEvent event, unsigned long id, unsigned char len);
+
     [[noreturn]] static void alert_task(void *parameter);
+    [[noreturn]] static void rx_task(void *parameter);
 
     static void canIdToN2k(unsigned long id, unsigned char &prio, unsigned long &pgn, unsigned char &src, unsigned char &dst);
 };
@@ -0,0 +1,118 @@
+/*
+NMEA2000_esp32_accounting.cpp
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NMEA2000_esp32_accounting.h"
+
+#define PGN_SLOT_MASK (ESP32_CAN_ACCOUNTING_PGNS - 1)
+#define PGN_SLOT_SHIFT (32 - __builtin_ctz(ESP32_CAN_ACCOUNTING_PGNS))
+
+static_assert((ESP32_CAN_ACCOUNTING_PGNS & PGN_SLOT_MASK) == 0, "ESP32_CAN_ACCOUNTING_PGNS must be a power of two");
+
+//*****************************************************************************
+void tCANTrafficAccounting::Count(unsigned char source, unsigned long pgn, unsigned char len, uint32_t bits)
+{
+    sources[source].Add(len, bits);
+
+    uint32_t key = (uint32_t)pgn + 1;
+    uint32_t slot = (uint32_t)(key * 2654435761U) >> PGN_SLOT_SHIFT; // Fibonacci hashing
+
+    for (int probe = 0; probe < ESP32_CAN_ACCOUNTING_PGNS; probe++, slot++)
+    {
+        tPGNSlot &entry = pgns[slot & PGN_SLOT_MASK];
+        uint32_t current = entry.Key.load(std::memory_order_acquire);
+
+        if (current == 0)
+        {
+            // Claim the free slot, or find out who beat us to it
+            if (entry.Key.compare_exchange_strong(current, key, std::memory_order_acq_rel, std::memory_order_acquire))
+                current = key;
+        }
+        if (current == key)
+        {
+            entry.Counters.Add(len, bits);
+            return;
+        }
+    }
+
+    pgn_overflow.Add(len, bits);
+}
+
+//*****************************************************************************
+tCANTraffic tCANTrafficAccounting::Read(uint32_t key, const tCounters &counters)
+{
+    return {key, counters.Frames.load(std::memory_order_relaxed), counters.Bytes.load(std::memory_order_relaxed),
+            counters.Bits.load(std::memory_order_relaxed)};
+}
+
+//*****************************************************************************
+// Insert entry into the sorted top list of count entries, returns the new count
+int tCANTrafficAccounting::Insert(tCANTraffic *top, int count, int max, const tCANTraffic &entry, tOrder order)
+{
+    auto value = [order](const tCANTraffic &traffic) {
+        return order == ByFrames ? traffic.Frames : (order == ByBytes ? traffic.Bytes : traffic.Bits);
+    };
+
+    if (entry.Frames == 0 || (count == max && value(entry) <= value(top[count - 1])))
+        return count;
+
+    int pos = count < max ? count++ : count - 1;
+
+    for (; pos > 0 && value(top[pos - 1]) < value(entry); pos--)
+        top[pos] = top[pos - 1];
+    top[pos] = entry;
+
+    return count;
+}
+
+//*****************************************************************************
+int tCANTrafficAccounting::TopSources(tCANTraffic *top, int max, tOrder order) const
+{
+    int count = 0;
+
+    if (max <= 0)
+        return 0;
+
+    for (int source = 0; source < 256; source++)
+        count = Insert(top, count, max, Read(source, sources[source]), order);
+
+    return count;
+}
+
+//*****************************************************************************
+int tCANTrafficAccounting::TopPGNs(tCANTraffic *top, int max, tOrder order) const
+{
+    int count = 0;
+
+    if (max <= 0)
+        return 0;
+
+    for (const tPGNSlot &slot : pgns)
+    {
+        uint32_t key = slot.Key.load(std::memory_order_acquire);
+
+        if (key != 0)
+            count = Insert(top, count, max, Read(key - 1, slot.Counters), order);
+    }
+
+    return count;
+}
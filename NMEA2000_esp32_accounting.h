@@ -0,0 +1,103 @@
+/*
+NMEA2000_esp32_accounting.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Traffic per source address and per PGN.
+
+Sources are a flat array indexed by address. PGNs live in an open addressing
+table: a slot is claimed by compare-and-swap of its key, so the receive and
+transmit paths can count concurrently without locks, and slots are never
+freed. PGNs seen after the table is full are counted as one overflow entry.
+Counters are relaxed atomics; a query scans the tables while counting goes on,
+so it sees each counter at some recent value and never stops the receive path.
+*/
+
+#ifndef _NMEA2000_ESP32_ACCOUNTING_H_
+#define _NMEA2000_ESP32_ACCOUNTING_H_
+
+#include <atomic>
+#include <stdint.h>
+
+// PGN table slots, a power of two. NMEA 2000 buses rarely carry more than 60 PGNs.
+#ifndef ESP32_CAN_ACCOUNTING_PGNS
+#define ESP32_CAN_ACCOUNTING_PGNS 128
+#endif
+
+struct tCANTraffic
+{
+    uint32_t Key; // Source address or PGN
+    uint32_t Frames;
+    uint32_t Bytes;
+    uint32_t Bits; // Stuffed bits on the wire, see CANFrameBits
+};
+
+class tCANTrafficAccounting
+{
+  public:
+    enum tOrder
+    {
+        ByFrames,
+        ByBytes,
+        ByBits
+    };
+
+  private:
+    struct tCounters
+    {
+        std::atomic<uint32_t> Frames{0};
+        std::atomic<uint32_t> Bytes{0};
+        std::atomic<uint32_t> Bits{0};
+
+        void Add(uint32_t bytes, uint32_t bits)
+        {
+            Frames.fetch_add(1, std::memory_order_relaxed);
+            Bytes.fetch_add(bytes, std::memory_order_relaxed);
+            Bits.fetch_add(bits, std::memory_order_relaxed);
+        }
+    };
+
+    struct tPGNSlot
+    {
+        std::atomic<uint32_t> Key{0}; // PGN + 1, 0 while free
+        tCounters Counters;
+    };
+
+    tCounters sources[256];
+    tPGNSlot pgns[ESP32_CAN_ACCOUNTING_PGNS];
+    tCounters pgn_overflow;
+
+    static tCANTraffic Read(uint32_t key, const tCounters &counters);
+    static int Insert(tCANTraffic *top, int count, int max, const tCANTraffic &entry, tOrder order);
+
+  public:
+    void Count(unsigned char source, unsigned long pgn, unsigned char len, uint32_t bits);
+
+    // Fill top with up to max entries with the most traffic, largest first, and
+    // return how many were filled
+    int TopSources(tCANTraffic *top, int max, tOrder order = ByBits) const;
+    int TopPGNs(tCANTraffic *top, int max, tOrder order = ByBits) const;
+
+    tCANTraffic GetSource(unsigned char source) const { return Read(source, sources[source]); }
+    // Traffic of PGNs that did not fit in the table
+    tCANTraffic GetPGNOverflow() const { return Read(0, pgn_overflow); }
+};
+
+#endif
@@ -0,0 +1,264 @@
+/*
+NMEA2000_esp32_filter.cpp
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NMEA2000_esp32_filter.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Filters work on the 18 bit PGN field, ID[25:8]
+#define PGN_FIELD_BITS 18
+#define PGN_FIELD_MASK 0x3FFFF
+#define PDU1_CARE_MASK 0x3FF00
+// Dual filters only see ID[28:13], which is PGN field bits 17..5
+#define DUAL_FILTER_CARE_MASK 0x3FFE0
+
+// ISO Acknowledgement, ISO Request, ISO Transport Protocol (data and connection management),
+// ISO Address Claim, ISO Commanded Address and NMEA Group Function
+static const unsigned long MandatoryPGNs[] = {59392L, 59904L, 60160L, 60416L, 60928L, 65240L, 126208L, 0};
+
+namespace
+{
+    // A set of PGN field values, the bits in Care are fixed to the bits in Value
+    struct tCube
+    {
+        uint32_t Value;
+        uint32_t Care;
+
+        uint32_t Count() const { return 1UL << (PGN_FIELD_BITS - __builtin_popcount(Care)); }
+    };
+
+    tCube PGNCube(unsigned long pgn)
+    {
+        uint32_t value = pgn & PGN_FIELD_MASK;
+        uint32_t pf = (value >> 8) & 0xFF;
+
+        if (pf < 240)
+            return {value & PDU1_CARE_MASK, PDU1_CARE_MASK};
+        return {value, PGN_FIELD_MASK};
+    }
+
+    // Builds the smallest cube containing every cube added to it
+    struct tCover
+    {
+        uint32_t First = 0;
+        uint32_t Care = PGN_FIELD_MASK;
+        uint32_t Diff = 0;
+        bool Empty = true;
+
+        void Add(const tCube &cube)
+        {
+            if (Empty)
+            {
+                First = cube.Value;
+                Empty = false;
+            }
+            Care &= cube.Care;
+            Diff |= cube.Value ^ First;
+        }
+
+        tCube Result(uint32_t care_limit) const
+        {
+            uint32_t care = Care & ~Diff & care_limit;
+            return {First & care, care};
+        }
+    };
+
+    tCube Cover(const tCube *cubes, int first, int last, uint32_t care_limit)
+    {
+        tCover cover;
+
+        for (int i = first; i < last; i++)
+            cover.Add(cubes[i]);
+
+        return cover.Result(care_limit);
+    }
+
+    uint32_t UnionCount(const tCube &a, const tCube &b)
+    {
+        uint32_t count = a.Count() + b.Count();
+
+        if (((a.Value ^ b.Value) & a.Care & b.Care) == 0)
+            count -= 1UL << (PGN_FIELD_BITS - __builtin_popcount(a.Care | b.Care));
+
+        return count;
+    }
+
+    int CompareCubes(const void *a, const void *b)
+    {
+        uint32_t va = ((const tCube *)a)->Value;
+        uint32_t vb = ((const tCube *)b)->Value;
+        return va < vb ? -1 : (va > vb ? 1 : 0);
+    }
+
+    uint16_t DualCode(const tCube &cube)
+    {
+        return ((cube.Value << 8) >> 13) & 0xFFFF;
+    }
+
+    uint16_t DualMask(const tCube &cube)
+    {
+        return ~((cube.Care << 8) >> 13) & 0xFFFF;
+    }
+}
+
+//*****************************************************************************
+bool BuildHwFilter(const unsigned long *pgns, tCANHwFilter &filter)
+{
+    tCube cubes[ESP32_CAN_HW_FILTER_MAX_PGNS];
+    int count = 0;
+
+    const unsigned long *lists[] = {MandatoryPGNs, pgns};
+
+    for (const unsigned long *list : lists)
+    {
+        for (; list != nullptr && *list != 0; list++)
+        {
+            if (count == ESP32_CAN_HW_FILTER_MAX_PGNS)
+            {
+                filter.Config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+                filter.AcceptedIds = filter.WantedIds = 1UL << PGN_FIELD_BITS;
+                filter.FalseAcceptRatio = 0;
+                return false;
+            }
+            cubes[count++] = PGNCube(*list);
+        }
+    }
+
+    // Sort and drop duplicates, so that contiguous ranges can be tried as dual filter halves
+    qsort(cubes, count, sizeof(tCube), CompareCubes);
+
+    int unique = 0;
+    uint32_t wanted = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (unique > 0 && cubes[unique - 1].Value == cubes[i].Value && cubes[unique - 1].Care == cubes[i].Care)
+            continue;
+        cubes[unique++] = cubes[i];
+        wanted += cubes[i].Count();
+    }
+    count = unique;
+
+    // Single filter over the full 29 bit ID
+    tCube single = Cover(cubes, 0, count, PGN_FIELD_MASK);
+    uint32_t best = single.Count();
+    bool use_dual = false;
+    tCube dual1, dual2;
+
+    auto try_dual = [&](const tCube &a, const tCube &b) {
+        uint32_t accepted = UnionCount(a, b);
+        if (accepted < best)
+        {
+            best = accepted;
+            use_dual = true;
+            dual1 = a;
+            dual2 = b;
+        }
+    };
+
+    // Dual filters: split at every position of the sorted list...
+    for (int split = 1; split < count; split++)
+    {
+        try_dual(Cover(cubes, 0, split, DUAL_FILTER_CARE_MASK), Cover(cubes, split, count, DUAL_FILTER_CARE_MASK));
+    }
+
+    // ...and on the value of every bit of the PGN field
+    for (int bit = 0; bit < PGN_FIELD_BITS; bit++)
+    {
+        tCover part[2];
+
+        for (int i = 0; i < count; i++)
+            part[(cubes[i].Value >> bit) & 1].Add(cubes[i]);
+
+        if (!part[0].Empty && !part[1].Empty)
+        {
+            try_dual(part[0].Result(DUAL_FILTER_CARE_MASK), part[1].Result(DUAL_FILTER_CARE_MASK));
+        }
+    }
+
+    if (use_dual)
+    {
+        filter.Config.acceptance_code = ((uint32_t)DualCode(dual1) << 16) | DualCode(dual2);
+        filter.Config.acceptance_mask = ((uint32_t)DualMask(dual1) << 16) | DualMask(dual2);
+        filter.Config.single_filter = false;
+    }
+    else
+    {
+        filter.Config.acceptance_code = (single.Value << 8) << 3;
+        filter.Config.acceptance_mask = ~((single.Care << 8) << 3);
+        filter.Config.single_filter = true;
+    }
+
+    filter.AcceptedIds = best;
+    filter.WantedIds = wanted;
+    filter.FalseAcceptRatio = best > wanted ? (float)(best - wanted) / best : 0;
+
+    return true;
+}
+
+//*****************************************************************************
+void tCANSwFilter::Begin()
+{
+    // Build in the table that is not in use, once no Check reads it any more
+    building = active.load(std::memory_order_relaxed) == &tables[0] ? &tables[1] : &tables[0];
+
+    while (readers.load() != 0)
+        vTaskDelay(1);
+
+    memset(building->PGNs, 0, sizeof(building->PGNs));
+    memset(building->Sources, 0xFF, sizeof(building->Sources));
+
+    for (const unsigned long *pgn = MandatoryPGNs; *pgn != 0; pgn++)
+        AcceptPGN(*pgn);
+}
+
+void tCANSwFilter::AcceptPGN(unsigned long pgn)
+{
+    if (building == nullptr || (pgn & 0x20000) != 0)
+        return;
+
+    uint32_t pf = (pgn >> 8) & 0xFF;
+    uint32_t dp = (pgn >> 16) & 1;
+    uint32_t index = pf < 240 ? dp * 240 + pf : PDU1_PGNS + ((dp << 12) | ((pf - 240) << 8) | (pgn & 0xFF));
+
+    building->PGNs[index >> 5] |= 1UL << (index & 31);
+}
+
+void tCANSwFilter::RejectSource(unsigned char source)
+{
+    if (building == nullptr)
+        return;
+
+    building->Sources[source >> 5] &= ~(1UL << (source & 31));
+}
+
+void tCANSwFilter::Commit()
+{
+    if (building == nullptr)
+        return;
+
+    active.store(building);
+    building = nullptr;
+}
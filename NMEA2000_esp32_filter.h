@@ -0,0 +1,168 @@
+/*
+NMEA2000_esp32_filter.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+TWAI acceptance filter for a set of NMEA 2000 PGNs.
+
+The TWAI controller offers one 29 bit code/mask pair, or two pairs that only see
+ID[28:13] of extended frames. BuildHwFilter picks whichever single or dual filter
+passes the smallest part of the PGN field (EDP, DP, PF and PS) while still passing
+every requested PGN and the ISO PGNs every node must receive. Priority and source
+address are never filtered, and neither is PS of PDU1 (addressed) PGNs.
+
+tCANSwFilter is the second stage, applied to every frame the controller lets
+through. It looks PGN and source up in bitmaps: every PDU2 PGN of both data pages
+has its own bit, and PDU1 PGNs are indexed directly by data page and PF, which is
+a perfect hash of the 480 possible PDU1 PGNs. A check costs a few loads whatever
+the number of PGNs. Tables are double buffered so that they can be rebuilt while
+frames are being received. Check counts itself in readers for as long as it looks
+at a table, and Begin waits for that count to reach zero before it clears the
+table no longer in use, which a Check that started before the last Commit may
+still be reading.
+*/
+
+#ifndef _NMEA2000_ESP32_FILTER_H_
+#define _NMEA2000_ESP32_FILTER_H_
+
+#include "driver/twai.h"
+#include <atomic>
+#include <stdint.h>
+
+#ifndef ESP32_CAN_HW_FILTER_MAX_PGNS
+#define ESP32_CAN_HW_FILTER_MAX_PGNS 128
+#endif
+
+struct tCANHwFilter
+{
+    twai_filter_config_t Config;
+
+    // Values of the 18 bit PGN field (EDP, DP, PF, PS) that pass the filter, and
+    // those that carry a wanted PGN. A PDU1 PGN covers all 256 PS values.
+    uint32_t AcceptedIds;
+    uint32_t WantedIds;
+
+    // Share of accepted frames the node does not want, assuming traffic is spread
+    // evenly over the PGN field
+    float FalseAcceptRatio;
+};
+
+// pgns is a zero terminated list. Returns false and an accept-all filter if the
+// list holds more than ESP32_CAN_HW_FILTER_MAX_PGNS PGNs.
+bool BuildHwFilter(const unsigned long *pgns, tCANHwFilter &filter);
+
+class tCANSwFilter
+{
+  public:
+    enum tResult
+    {
+        Accepted,
+        RejectedPGN,
+        RejectedSource
+    };
+
+  private:
+    static const int PDU1_PGNS = 2 * 240;
+    static const int PDU2_PGNS = 2 * 16 * 256;
+
+    struct tTable
+    {
+        uint32_t PGNs[(PDU1_PGNS + PDU2_PGNS + 31) / 32];
+        uint32_t Sources[256 / 32];
+    };
+
+    tTable tables[2];
+    std::atomic<const tTable *> active{nullptr};
+    std::atomic<uint32_t> readers{0};
+    tTable *building = nullptr;
+
+    std::atomic<uint32_t> passed{0};
+    std::atomic<uint32_t> rejected_pgn{0};
+    std::atomic<uint32_t> rejected_source{0};
+
+    static bool Test(const uint32_t *bits, uint32_t index) { return (bits[index >> 5] >> (index & 31)) & 1; }
+
+  public:
+    // Start a new table that rejects every PGN except the mandatory ISO PGNs and
+    // accepts every source. The filter in use is unaffected until Commit.
+    // Begin, AcceptPGN, RejectSource and Commit must be called from one task, and
+    // not from an ISR: Begin waits for Checks still reading the old table.
+    void Begin();
+    void AcceptPGN(unsigned long pgn);
+    void RejectSource(unsigned char source);
+    void Commit();
+
+    // Accept everything again
+    void Disable() { active.store(nullptr); }
+    bool IsEnabled() const { return active.load(std::memory_order_relaxed) != nullptr; }
+
+    tResult Check(unsigned long id)
+    {
+        if (active.load(std::memory_order_relaxed) == nullptr)
+            return Accepted;
+
+        // Counted before the table is loaded, so Begin either sees this reader or
+        // it is done clearing and this Check loads the table committed last
+        readers.fetch_add(1);
+
+        const tTable *table = active.load();
+        tResult result = Accepted;
+
+        if (table != nullptr)
+        {
+            uint32_t pf = (id >> 16) & 0xFF;
+            uint32_t dp = (id >> 24) & 1;
+            uint32_t index = pf < 240 ? dp * 240 + pf : PDU1_PGNS + ((dp << 12) | ((pf - 240) << 8) | ((id >> 8) & 0xFF));
+
+            // The extended data page is not used by NMEA 2000
+            if ((id & 0x02000000) != 0 || !Test(table->PGNs, index))
+                result = RejectedPGN;
+            else if (!Test(table->Sources, id & 0xFF))
+                result = RejectedSource;
+        }
+
+        readers.fetch_sub(1, std::memory_order_release);
+
+        if (table == nullptr)
+            return Accepted;
+
+        switch (result)
+        {
+        case RejectedPGN:
+            rejected_pgn.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case RejectedSource:
+            rejected_source.fetch_add(1, std::memory_order_relaxed);
+            break;
+        default:
+            passed.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+
+        return result;
+    }
+
+    // Frames checked while the filter was enabled, by outcome
+    uint32_t GetPassed() const { return passed.load(std::memory_order_relaxed); }
+    uint32_t GetRejectedPGN() const { return rejected_pgn.load(std::memory_order_relaxed); }
+    uint32_t GetRejectedSource() const { return rejected_source.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,178 @@
+/*
+NMEA2000_esp32_framelen.cpp
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NMEA2000_esp32_framelen.h"
+
+// CRC delimiter, ACK slot, ACK delimiter, 7 bit EOF and 3 bit intermission
+#define FRAME_TAIL_BITS 13
+#define CRC15_POLY 0x4599
+
+namespace
+{
+    // Stuffing state between bytes: the value of the last bit and how many equal
+    // bits end the stream so far (0 before SOF)
+    constexpr uint8_t StuffState(uint8_t last, uint8_t run) { return (uint8_t)((run << 1) | last); }
+
+    struct tStuffStep
+    {
+        uint8_t State;
+        uint8_t Stuffed;
+    };
+
+    constexpr tStuffStep StuffBits(uint8_t state, uint32_t bits, int count)
+    {
+        uint8_t last = state & 1;
+        uint8_t run = state >> 1;
+        uint8_t stuffed = 0;
+
+        for (int i = count - 1; i >= 0; i--)
+        {
+            uint8_t bit = (bits >> i) & 1;
+
+            if (run != 0 && bit == last)
+                run++;
+            else
+            {
+                last = bit;
+                run = 1;
+            }
+            if (run == 5)
+            {
+                // The stuff bit starts the next run
+                stuffed++;
+                last = !last;
+                run = 1;
+            }
+        }
+
+        return {StuffState(last, run), stuffed};
+    }
+
+    constexpr int STUFF_STATES = 12;
+
+    struct tTables
+    {
+        // State byte: bits 7..4 next state, bits 1..0 stuff bits inserted
+        uint8_t Stuff[STUFF_STATES][256];
+        uint16_t Crc[256];
+
+        constexpr tTables() : Stuff(), Crc()
+        {
+            for (int state = 0; state < STUFF_STATES; state++)
+            {
+                for (int byte = 0; byte < 256; byte++)
+                {
+                    tStuffStep step = StuffBits((uint8_t)state, byte, 8);
+                    Stuff[state][byte] = (uint8_t)((step.State << 4) | step.Stuffed);
+                }
+            }
+
+            for (int byte = 0; byte < 256; byte++)
+            {
+                uint16_t crc = (uint16_t)(byte << 7);
+                for (int i = 0; i < 8; i++)
+                    crc = (uint16_t)(((crc << 1) ^ ((crc & 0x4000) ? CRC15_POLY : 0)) & 0x7FFF);
+                Crc[byte] = crc;
+            }
+        }
+    };
+
+    constexpr tTables Tables;
+
+    uint16_t Crc15Bits(uint16_t crc, uint32_t bits, int count)
+    {
+        for (int i = count - 1; i >= 0; i--)
+        {
+            uint32_t next = ((bits >> i) & 1) ^ ((crc >> 14) & 1);
+            crc = (uint16_t)((crc << 1) & 0x7FFF);
+            if (next)
+                crc ^= CRC15_POLY;
+        }
+        return crc;
+    }
+
+    // Appends bits MSB first into a byte buffer. Put writes the four bytes from the
+    // current one, so the buffer needs three bytes of slack.
+    struct tBitWriter
+    {
+        uint8_t *Buffer;
+        uint32_t Bits = 0;
+
+        void Put(uint32_t value, int count) // count <= 24
+        {
+            uint8_t *p = &Buffer[Bits >> 3];
+            uint32_t shift = Bits & 7;
+            uint32_t window = (shift != 0 ? (uint32_t)p[0] << 24 : 0) | ((value << (32 - count)) >> shift);
+
+            p[0] = (uint8_t)(window >> 24);
+            p[1] = (uint8_t)(window >> 16);
+            p[2] = (uint8_t)(window >> 8);
+            p[3] = (uint8_t)window;
+            Bits += count;
+        }
+    };
+}
+
+//*****************************************************************************
+uint32_t CANFrameBits(unsigned long id, unsigned char len, const unsigned char *data)
+{
+    // SOF to CRC of a frame with 8 data bytes is 118 bits
+    uint8_t stream[15 + 3];
+    tBitWriter writer{stream};
+
+    if (len > 8)
+        len = 8;
+
+    // SOF, ID[28:18], SRR, IDE, ID[17:0], RTR, r1, r0 and DLC: 39 bits
+    writer.Put((uint32_t)((id >> 18) & 0x7FF) << 2 | 0x3, 14);
+    writer.Put((uint32_t)id & 0x3FFFF, 18);
+    writer.Put(len, 7);
+
+    for (int i = 0; i < len; i++)
+        writer.Put(data[i], 8);
+
+    // CRC over whole bytes from the table, the last partial byte bit by bit
+    uint32_t whole = writer.Bits >> 3;
+    uint16_t crc = 0;
+
+    for (uint32_t i = 0; i < whole; i++)
+        crc = (uint16_t)(((crc << 8) ^ Tables.Crc[((crc >> 7) ^ stream[i]) & 0xFF]) & 0x7FFF);
+    crc = Crc15Bits(crc, stream[whole] >> (8 - (writer.Bits & 7)), writer.Bits & 7);
+
+    writer.Put(crc, 15);
+
+    // Stuff bits
+    whole = writer.Bits >> 3;
+    uint8_t state = StuffState(0, 0);
+    uint32_t stuffed = 0;
+
+    for (uint32_t i = 0; i < whole; i++)
+    {
+        uint8_t step = Tables.Stuff[state][stream[i]];
+        stuffed += step & 0x3;
+        state = step >> 4;
+    }
+    stuffed += StuffBits(state, stream[whole] >> (8 - (writer.Bits & 7)), writer.Bits & 7).Stuffed;
+
+    return writer.Bits + stuffed + FRAME_TAIL_BITS;
+}
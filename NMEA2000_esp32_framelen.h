@@ -0,0 +1,41 @@
+/*
+NMEA2000_esp32_framelen.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Exact length on the wire of an extended CAN data frame.
+
+A frame costs more than its header and data: the controller inserts a stuff
+bit after five equal bits from SOF to the end of the CRC, so the count depends
+on the ID, the data and the CRC. CANFrameBits builds the unstuffed bit stream,
+computes the CRC and counts stuff bits with byte-wide lookup tables, and adds
+the fixed tail: CRC delimiter, ACK slot and delimiter, end of frame and the
+three bit intermission.
+*/
+
+#ifndef _NMEA2000_ESP32_FRAMELEN_H_
+#define _NMEA2000_ESP32_FRAMELEN_H_
+
+#include <stdint.h>
+
+// Bits an extended data frame keeps the bus busy, 67 + 8 * len plus stuff bits
+uint32_t CANFrameBits(unsigned long id, unsigned char len, const unsigned char *data);
+
+#endif
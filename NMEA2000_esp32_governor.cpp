@@ -0,0 +1,189 @@
+/*
+NMEA2000_esp32_governor.cpp
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NMEA2000_esp32_governor.h"
+
+#define WINDOW_BITS_MASK 0xFFFF
+
+#define LOAD_MASK 0x3FFF
+#define RELEASE_SHIFT 14
+#define PRIORITY_SHIFT 28
+#define DROP_BIT (1UL << 31)
+
+// PDU1 formats of the ISO 11783 transport protocol, TP.DT and TP.CM
+#define PF_TP_DT 0xEB
+#define PF_TP_CM 0xEC
+
+//*****************************************************************************
+void tCANTxGovernor::SetBitrate(uint32_t bitrate)
+{
+    uint64_t capacity = (uint64_t)bitrate * WINDOW_US / 1000000;
+
+    window_capacity.store(capacity < WINDOW_BITS_MASK ? (uint32_t)capacity : WINDOW_BITS_MASK, std::memory_order_relaxed);
+}
+
+void tCANTxGovernor::Configure(uint32_t target_load, uint32_t release_load, int throttled_priority, tPolicy policy)
+{
+    uint32_t target = target_load < LOAD_MASK ? target_load : LOAD_MASK;
+    uint32_t release = release_load < target ? release_load : target;
+
+    if (throttled_priority < 0)
+        throttled_priority = 0;
+    if (throttled_priority > 7)
+        target = 0;
+
+    settings.store(target | release << RELEASE_SHIFT | (uint32_t)(throttled_priority & 7) << PRIORITY_SHIFT | (policy == Drop ? DROP_BIT : 0),
+                   std::memory_order_relaxed);
+    throttling.store(false, std::memory_order_relaxed);
+}
+
+//*****************************************************************************
+void tCANTxGovernor::Count(uint32_t bits, int64_t now)
+{
+    uint32_t number = (uint32_t)(now / WINDOW_US);
+    std::atomic<uint32_t> &window = windows[number & 1];
+    uint32_t tag = (number & 0xFFFF) << 16;
+    uint32_t old = window.load(std::memory_order_relaxed);
+    uint32_t updated;
+
+    do
+    {
+        // The first frame of a window clears what is left from two windows back
+        uint32_t counted = (old & ~WINDOW_BITS_MASK) == tag ? old & WINDOW_BITS_MASK : 0;
+        counted += bits;
+        updated = tag | (counted < WINDOW_BITS_MASK ? counted : WINDOW_BITS_MASK);
+    } while (!window.compare_exchange_weak(old, updated, std::memory_order_relaxed));
+}
+
+uint32_t tCANTxGovernor::GetLoad(int64_t now) const
+{
+    uint32_t capacity = window_capacity.load(std::memory_order_relaxed);
+
+    if (capacity == 0)
+        return 0;
+
+    uint32_t number = (uint32_t)(now / WINDOW_US);
+    uint32_t elapsed = (uint32_t)(now % WINDOW_US);
+    uint32_t current = windows[number & 1].load(std::memory_order_relaxed);
+    uint32_t previous = windows[(number - 1) & 1].load(std::memory_order_relaxed);
+
+    uint32_t current_bits = current >> 16 == (number & 0xFFFF) ? current & WINDOW_BITS_MASK : 0;
+    uint32_t previous_bits = previous >> 16 == ((number - 1) & 0xFFFF) ? previous & WINDOW_BITS_MASK : 0;
+
+    // The share of the previous window that a window ending now still covers
+    uint64_t bits = current_bits + (uint64_t)previous_bits * (WINDOW_US - elapsed) / WINDOW_US;
+
+    return (uint32_t)(bits * 10000 / capacity);
+}
+
+//*****************************************************************************
+tCANTxGovernor::tResult tCANTxGovernor::Check(unsigned long id, bool starts, uint32_t frames, int64_t now)
+{
+    uint32_t config = settings.load(std::memory_order_relaxed);
+    uint32_t target_load = config & LOAD_MASK;
+    uint32_t release_load = (config >> RELEASE_SHIFT) & LOAD_MASK;
+    int priority = (int)((id >> 26) & 7);
+
+    if (target_load == 0 || priority < (int)((config >> PRIORITY_SHIFT) & 7))
+        return Passed;
+
+    uint32_t load = GetLoad(now);
+    bool throttle = throttling.load(std::memory_order_relaxed);
+
+    if (!throttle && load > target_load)
+    {
+        throttle = true;
+        throttling.store(true, std::memory_order_relaxed);
+        throttles.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (throttle && load < release_load)
+    {
+        throttle = false;
+        throttling.store(false, std::memory_order_relaxed);
+    }
+
+    unsigned char pf = (unsigned char)(id >> 16);
+    bool drop = (config & DROP_BIT) != 0 && pf != PF_TP_DT && pf != PF_TP_CM;
+    tResult result = !throttle ? Passed : drop ? Dropped : Deferred;
+
+    // The rest of a message sent frame by frame goes the way its first frame went.
+    // A deferred frame is sent again, so only passing and dropping latch.
+    portENTER_CRITICAL(&latch_lock);
+
+    tLatch *latch = nullptr;
+    tLatch *oldest = &latches[0];
+
+    for (tLatch &entry : latches)
+    {
+        if (entry.Until > now && entry.Id == id)
+            latch = &entry;
+        if (entry.Until < oldest->Until)
+            oldest = &entry;
+    }
+
+    if (latch != nullptr && !starts)
+    {
+        result = latch->Result;
+    }
+    else if (result != Deferred)
+    {
+        latch = latch != nullptr ? latch : oldest;
+        latch->Id = id;
+        latch->Until = now + ESP32_CAN_TX_GOVERNOR_LATCH_MS * 1000;
+        latch->Result = result;
+    }
+    else if (latch != nullptr)
+    {
+        latch->Until = 0;
+    }
+
+    portEXIT_CRITICAL(&latch_lock);
+
+    switch (result)
+    {
+    case Passed:
+        passed.fetch_add(frames, std::memory_order_relaxed);
+        break;
+    case Dropped:
+        dropped.fetch_add(frames, std::memory_order_relaxed);
+        break;
+    case Deferred:
+        deferred.fetch_add(frames, std::memory_order_relaxed);
+        break;
+    }
+
+    return result;
+}
+
+//*****************************************************************************
+tCANTxGovernor::tCounters tCANTxGovernor::GetCounters() const
+{
+    tCounters counters;
+
+    counters.Passed = passed.load(std::memory_order_relaxed);
+    counters.Dropped = dropped.load(std::memory_order_relaxed);
+    counters.Deferred = deferred.load(std::memory_order_relaxed);
+    counters.Throttles = throttles.load(std::memory_order_relaxed);
+
+    return counters;
+}
@@ -0,0 +1,141 @@
+/*
+NMEA2000_esp32_governor.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Bus load governor for transmitted frames.
+
+The driver adds the stuffed length of every frame it receives or queues. The
+load is the bits of the current window plus the part of the previous window
+that a sliding window would still hold, so it follows the bus within a window
+without a timer. When it rises above the target, frames of the throttled
+priority and below (numerically greater or equal) are dropped or deferred as
+the policy says, until it falls under the release level.
+
+Only frames the driver sees count: frames the TWAI acceptance filter rejects
+are missed, and received frames count when they leave the TWAI RX queue, so
+enable the RX task (EnableRxTask) for a live figure.
+
+Decisions hold for whole messages. The NMEA2000 library sends a fast packet
+message frame by frame, and a message that lost a middle frame is lost whole
+while the library counts it as sent. So a CAN id keeps the decision made at its
+first throttled-priority frame for the frames that follow, until a frame that
+may start a message (fast packet frame counter 0) or ESP32_CAN_TX_GOVERNOR_LATCH_MS
+after the decision. ISO 11783 transport protocol frames (TP.CM and TP.DT) are
+never dropped, only deferred, as a session cannot skip a frame.
+
+Counting is lock-free. Each window is a 32 bit word holding the low 16 bits of
+the window number and the bits counted in it, updated by compare-and-swap, so
+windows can hold at most 65535 bits. Configure publishes its settings as one
+word the same way. Checking frames of throttled priorities takes a spinlock for
+the table of latched decisions.
+*/
+
+#ifndef _NMEA2000_ESP32_GOVERNOR_H_
+#define _NMEA2000_ESP32_GOVERNOR_H_
+
+#include "freertos/FreeRTOS.h"
+#include <atomic>
+#include <stdint.h>
+
+#ifndef ESP32_CAN_TX_GOVERNOR_WINDOW_MS
+#define ESP32_CAN_TX_GOVERNOR_WINDOW_MS 100
+#endif
+// Longest a decision holds for the frames of one message, and the CAN ids that
+// can hold one at a time
+#ifndef ESP32_CAN_TX_GOVERNOR_LATCH_MS
+#define ESP32_CAN_TX_GOVERNOR_LATCH_MS 100
+#endif
+#ifndef ESP32_CAN_TX_GOVERNOR_LATCHES
+#define ESP32_CAN_TX_GOVERNOR_LATCHES 8
+#endif
+
+class tCANTxGovernor
+{
+  public:
+    enum tPolicy
+    {
+        Drop,
+        Defer
+    };
+
+    enum tResult
+    {
+        Passed,
+        Dropped,
+        Deferred
+    };
+
+    struct tCounters
+    {
+        uint32_t Passed;    // Frames of throttled priorities let through
+        uint32_t Dropped;
+        uint32_t Deferred;
+        uint32_t Throttles; // Times the load rose above the target
+    };
+
+  private:
+    static const uint32_t WINDOW_US = ESP32_CAN_TX_GOVERNOR_WINDOW_MS * 1000;
+
+    struct tLatch
+    {
+        unsigned long Id;
+        int64_t Until;
+        tResult Result;
+    };
+
+    std::atomic<uint32_t> windows[2] = {};
+    std::atomic<uint32_t> window_capacity{0}; // Bits a window holds at full load
+
+    // Target load (bits 0-13), release load (14-27), throttled priority (28-30) and
+    // policy (31). Loads in hundredths of a percent, a 0 target disables throttling.
+    std::atomic<uint32_t> settings{0};
+
+    tLatch latches[ESP32_CAN_TX_GOVERNOR_LATCHES] = {};
+    portMUX_TYPE latch_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    std::atomic<bool> throttling{false};
+    std::atomic<uint32_t> passed{0};
+    std::atomic<uint32_t> dropped{0};
+    std::atomic<uint32_t> deferred{0};
+    std::atomic<uint32_t> throttles{0};
+
+  public:
+    void SetBitrate(uint32_t bitrate);
+
+    // Throttle priorities throttled_priority..7 while the load is above
+    // target_load, until it falls under release_load. Loads in hundredths of a
+    // percent up to 16383, e.g. 6000 and 5000. A target of 0, or a priority above
+    // 7, disables the governor. Safe to call while frames are sent.
+    void Configure(uint32_t target_load, uint32_t release_load, int throttled_priority, tPolicy policy);
+
+    void Count(uint32_t bits, int64_t now);
+    // Load over the last window, in hundredths of a percent
+    uint32_t GetLoad(int64_t now) const;
+
+    // frames frames of one message with this CAN id. starts says whether the
+    // first of them may begin a message.
+    tResult Check(unsigned long id, bool starts, uint32_t frames, int64_t now);
+
+    bool IsThrottling() const { return throttling.load(std::memory_order_relaxed); }
+    tCounters GetCounters() const;
+};
+
+#endif
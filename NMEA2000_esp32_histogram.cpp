@@ -0,0 +1,82 @@
+/*
+NMEA2000_esp32_histogram.cpp
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NMEA2000_esp32_histogram.h"
+
+//*****************************************************************************
+uint32_t tLatencyHistogram::BucketLowest(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+    uint32_t sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+
+    return (SUB_BUCKETS + sub) << shift;
+}
+
+uint32_t tLatencyHistogram::BucketHighest(int bucket)
+{
+    return bucket + 1 < BUCKETS ? BucketLowest(bucket + 1) - 1 : (1UL << MAX_BITS) - 1;
+}
+
+//*****************************************************************************
+tLatencySummary tLatencyHistogram::Summary() const
+{
+    tLatencySummary summary = {};
+    uint64_t weighted = 0;
+    uint32_t seen = 0;
+
+    // Buckets may grow between the passes, ranks come from the first pass
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        uint32_t n = buckets[i].load(std::memory_order_relaxed);
+        seen += n;
+        weighted += (uint64_t)n * ((BucketLowest(i) + BucketHighest(i)) / 2);
+    }
+
+    if (seen == 0)
+        return summary;
+
+    summary.Count = seen;
+    summary.MaxUs = max.load(std::memory_order_relaxed);
+    summary.MeanUs = (uint32_t)(weighted / seen);
+
+    // Ranks of the percentiles, rounded up
+    const uint64_t ranks[] = {((uint64_t)seen * 500 + 999) / 1000, ((uint64_t)seen * 990 + 999) / 1000, ((uint64_t)seen * 999 + 999) / 1000};
+    uint32_t *results[] = {&summary.P50Us, &summary.P99Us, &summary.P999Us};
+    uint64_t cumulative = 0;
+    int next = 0;
+
+    for (int i = 0; i < BUCKETS && next < 3; i++)
+    {
+        cumulative += buckets[i].load(std::memory_order_relaxed);
+        while (next < 3 && cumulative >= ranks[next])
+        {
+            uint32_t highest = BucketHighest(i);
+            *results[next++] = highest < summary.MaxUs ? highest : summary.MaxUs;
+        }
+    }
+
+    return summary;
+}
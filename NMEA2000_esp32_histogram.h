@@ -0,0 +1,87 @@
+/*
+NMEA2000_esp32_histogram.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Log-linear latency histogram in the style of HdrHistogram.
+
+Values in microseconds below 16 have a bucket each; above that every power of
+two is split into 16 buckets, so a value is known to within 1/16 (6%) up to
+the 16.7 s limit, in 1.3 kB. Recording is a count-leading-zeros, a relaxed
+atomic add and a max update, safe from any number of tasks, and reading
+summarises the buckets while recording goes on.
+*/
+
+#ifndef _NMEA2000_ESP32_HISTOGRAM_H_
+#define _NMEA2000_ESP32_HISTOGRAM_H_
+
+#include <atomic>
+#include <stdint.h>
+
+struct tLatencySummary
+{
+    uint32_t Count;
+    uint32_t MeanUs; // From the bucket midpoints
+    // Highest value of the bucket holding the percentile, in us
+    uint32_t P50Us;
+    uint32_t P99Us;
+    uint32_t P999Us;
+    uint32_t MaxUs;
+};
+
+class tLatencyHistogram
+{
+  private:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS = 24; // Values are clamped to 2^24 - 1 us
+    static const int BUCKETS = SUB_BUCKETS + (MAX_BITS - SUB_BITS) * SUB_BUCKETS;
+
+    std::atomic<uint32_t> buckets[BUCKETS] = {};
+    std::atomic<uint32_t> max{0};
+
+    static int Bucket(uint32_t value)
+    {
+        if (value < SUB_BUCKETS)
+            return value;
+
+        int shift = 31 - __builtin_clz(value) - SUB_BITS;
+        return SUB_BUCKETS + shift * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint32_t BucketLowest(int bucket);
+    static uint32_t BucketHighest(int bucket);
+
+  public:
+    void Record(int64_t us)
+    {
+        uint32_t value = us < 0 ? 0 : (us >= (1 << MAX_BITS) ? (1 << MAX_BITS) - 1 : (uint32_t)us);
+
+        buckets[Bucket(value)].fetch_add(1, std::memory_order_relaxed);
+
+        uint32_t current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+            ;
+    }
+
+    tLatencySummary Summary() const;
+};
+
+#endif
@@ -0,0 +1,188 @@
+/*
+NMEA2000_esp32_limiter.cpp
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NMEA2000_esp32_limiter.h"
+
+//*****************************************************************************
+bool tCANTxLimiter::AddRule(unsigned long pgn, uint32_t frames_per_second, uint32_t burst, tPolicy policy, int destination)
+{
+    if (frames_per_second == 0)
+        return false;
+
+    uint32_t cost = frames_per_second < 1000000 ? 1000000 / frames_per_second : 1;
+    uint64_t capacity = (uint64_t)cost * (burst != 0 ? burst : 1);
+    bool added = false;
+
+    portENTER_CRITICAL(&lock);
+
+    if (rule_count < ESP32_CAN_TX_LIMITER_RULES)
+    {
+        tRule &rule = rules[rule_count++];
+
+        rule.PGN = pgn;
+        rule.Destination = destination;
+        rule.Policy = policy;
+        rule.CostUs = cost;
+        rule.CapacityUs = capacity < UINT32_MAX ? (uint32_t)capacity : UINT32_MAX;
+        rule.CreditUs = rule.CapacityUs;
+        rule.Refilled = -1;
+        rule.Counters = {};
+        added = true;
+    }
+
+    portEXIT_CRITICAL(&lock);
+
+    return added;
+}
+
+void tCANTxLimiter::Clear()
+{
+    portENTER_CRITICAL(&lock);
+    rule_count = 0;
+    portEXIT_CRITICAL(&lock);
+}
+
+//*****************************************************************************
+int tCANTxLimiter::Find(unsigned long id) const
+{
+    unsigned char pf = (unsigned char)(id >> 16);
+    unsigned long pgn = ((id >> 24) & 1) << 16 | (unsigned long)pf << 8;
+    int destination = 0xFF;
+    int any = -1;
+
+    if (pf < 240)
+        destination = (id >> 8) & 0xFF;
+    else
+        pgn |= (id >> 8) & 0xFF;
+
+    for (int i = 0; i < rule_count; i++)
+    {
+        const tRule &rule = rules[i];
+
+        if (rule.PGN == pgn && (rule.Destination == AnyDestination || rule.Destination == destination))
+            return i;
+        if (rule.PGN == AnyPGN && any < 0)
+            any = i;
+    }
+
+    return any;
+}
+
+//*****************************************************************************
+tCANTxLimiter::tResult tCANTxLimiter::Check(unsigned long id, uint32_t frames, int64_t now)
+{
+    tResult result = Passed;
+
+    portENTER_CRITICAL(&lock);
+
+    int index = Find(id);
+
+    if (index >= 0)
+    {
+        tRule &rule = rules[index];
+        int64_t elapsed = now - rule.Refilled;
+        uint64_t needed = (uint64_t)rule.CostUs * frames;
+
+        // The first frame finds the bucket full
+        if (rule.Refilled < 0 || elapsed >= (int64_t)(rule.CapacityUs - rule.CreditUs))
+            rule.CreditUs = rule.CapacityUs;
+        else if (elapsed > 0)
+            rule.CreditUs += (uint32_t)elapsed;
+        rule.Refilled = now;
+
+        if (needed <= rule.CreditUs)
+        {
+            rule.CreditUs -= (uint32_t)needed;
+            rule.Counters.Passed += frames;
+        }
+        else if (needed > rule.CapacityUs)
+        {
+            // Not even a full bucket holds it; deferring would retry it for ever
+            rule.Counters.Dropped += frames;
+            rule.Counters.Oversized += frames;
+            result = Dropped;
+        }
+        else if (rule.Policy == Drop)
+        {
+            rule.Counters.Dropped += frames;
+            result = Dropped;
+        }
+        else
+        {
+            rule.Counters.Deferred += frames;
+            result = Deferred;
+        }
+    }
+
+    portEXIT_CRITICAL(&lock);
+
+    return result;
+}
+
+void tCANTxLimiter::Refund(unsigned long id, uint32_t frames)
+{
+    portENTER_CRITICAL(&lock);
+
+    int index = Find(id);
+
+    if (index >= 0)
+    {
+        tRule &rule = rules[index];
+        uint64_t credit = rule.CreditUs + (uint64_t)rule.CostUs * frames;
+
+        rule.CreditUs = credit < rule.CapacityUs ? (uint32_t)credit : rule.CapacityUs;
+        rule.Counters.Passed -= frames < rule.Counters.Passed ? frames : rule.Counters.Passed;
+    }
+
+    portEXIT_CRITICAL(&lock);
+}
+
+//*****************************************************************************
+tCANTxLimiter::tCounters tCANTxLimiter::GetCounters(int rule)
+{
+    tCounters counters = {};
+
+    portENTER_CRITICAL(&lock);
+    if (rule >= 0 && rule < rule_count)
+        counters = rules[rule].Counters;
+    portEXIT_CRITICAL(&lock);
+
+    return counters;
+}
+
+tCANTxLimiter::tCounters tCANTxLimiter::GetTotals()
+{
+    tCounters totals = {};
+
+    portENTER_CRITICAL(&lock);
+    for (int i = 0; i < rule_count; i++)
+    {
+        totals.Passed += rules[i].Counters.Passed;
+        totals.Dropped += rules[i].Counters.Dropped;
+        totals.Deferred += rules[i].Counters.Deferred;
+        totals.Oversized += rules[i].Counters.Oversized;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    return totals;
+}
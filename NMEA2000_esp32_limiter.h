@@ -0,0 +1,117 @@
+/*
+NMEA2000_esp32_limiter.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Token bucket rate limits on transmitted frames.
+
+A rule gives a PGN, and optionally a destination address, a rate in frames per
+second and a burst. Its bucket holds up to burst frames worth of credit and
+refills at the rate; a frame that finds less than one frame of credit is over
+the limit and is either dropped, which the sender sees as sent, or deferred,
+which fails the send so that the NMEA2000 library keeps the frame and retries.
+A rule for AnyPGN covers the frames no other rule matches, as one bucket.
+Credit taken for frames the driver then fails to queue is given back with
+Refund, so that a frame the library retries is not charged twice.
+
+Limits count frames. The frames of a fast packet message must all be sent for
+the message to be of use, so give fast packet PGNs the Defer policy, with a
+burst of at least the frames of their longest message. A message of more frames
+than the burst could never pass, so it is dropped whatever the policy and
+counted in Oversized as well as Dropped.
+
+Rules are searched in order, so put the busiest first. Check may be called from
+any task, a spinlock guards the buckets.
+*/
+
+#ifndef _NMEA2000_ESP32_LIMITER_H_
+#define _NMEA2000_ESP32_LIMITER_H_
+
+#include "freertos/FreeRTOS.h"
+#include <stdint.h>
+
+#ifndef ESP32_CAN_TX_LIMITER_RULES
+#define ESP32_CAN_TX_LIMITER_RULES 16
+#endif
+
+class tCANTxLimiter
+{
+  public:
+    enum tPolicy
+    {
+        Drop,
+        Defer
+    };
+
+    enum tResult
+    {
+        Passed,
+        Dropped,
+        Deferred
+    };
+
+    // Above the 18 bit PGNs, as PGN 0 is a real one
+    static const unsigned long AnyPGN = 1UL << 18;
+    static const int AnyDestination = -1;
+
+    struct tCounters
+    {
+        uint32_t Passed;
+        uint32_t Dropped;
+        uint32_t Deferred;
+        uint32_t Oversized; // Of Dropped, frames of messages longer than the burst
+    };
+
+  private:
+    struct tRule
+    {
+        unsigned long PGN;
+        int Destination;
+        tPolicy Policy;
+        uint32_t CostUs;     // Credit a frame takes, 1 s / rate
+        uint32_t CapacityUs; // Credit of burst frames
+        uint32_t CreditUs;
+        int64_t Refilled; // -1 until the first frame
+        tCounters Counters;
+    };
+
+    tRule rules[ESP32_CAN_TX_LIMITER_RULES];
+    int rule_count = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    int Find(unsigned long id) const;
+
+  public:
+    // Returns false when all ESP32_CAN_TX_LIMITER_RULES rules are in use or
+    // frames_per_second is 0. destination only applies to PDU1 PGNs.
+    bool AddRule(unsigned long pgn, uint32_t frames_per_second, uint32_t burst, tPolicy policy, int destination = AnyDestination);
+    void Clear();
+
+    // Take credit for frames frames with this CAN id, all or nothing
+    tResult Check(unsigned long id, uint32_t frames, int64_t now);
+    // Give back the credit of frames that passed Check but were not sent
+    void Refund(unsigned long id, uint32_t frames);
+
+    int GetRuleCount() const { return rule_count; }
+    tCounters GetCounters(int rule);
+    tCounters GetTotals();
+};
+
+#endif
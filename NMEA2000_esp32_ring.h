@@ -0,0 +1,108 @@
+/*
+NMEA2000_esp32_ring.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Single producer, single consumer ring buffer without locks. One task may push
+and one other task may pop concurrently. The storage is provided by the caller
+so that it can be placed in PSRAM, and its size must be a power of two.
+*/
+
+#ifndef _NMEA2000_ESP32_RING_H_
+#define _NMEA2000_ESP32_RING_H_
+
+#include <atomic>
+#include <stdint.h>
+
+// Smallest ring size that holds count items
+constexpr uint32_t SpscRingSizeFor(uint32_t count)
+{
+    uint32_t size = 1;
+    while (size < count)
+        size <<= 1;
+    return size;
+}
+
+template <typename T>
+class tSpscRingBuffer
+{
+  private:
+    T *items = nullptr;
+    uint32_t mask = 0;
+
+    std::atomic<uint32_t> head{0}; // Next slot to write, owned by the producer
+    std::atomic<uint32_t> tail{0}; // Next slot to read, owned by the consumer
+
+  public:
+    bool Init(T *storage, uint32_t size)
+    {
+        if (storage == nullptr || size == 0 || (size & (size - 1)) != 0)
+            return false;
+
+        items = storage;
+        mask = size - 1;
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint32_t Size() const { return mask + 1; }
+
+    uint32_t Count() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    // Producer side. Returns false when the ring is full.
+    bool Push(const T &item)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+
+        if (h - tail.load(std::memory_order_acquire) > mask)
+            return false;
+
+        items[h & mask] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. The oldest item, nullptr when empty, valid until it is popped.
+    const T *Front() const
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+
+        if (head.load(std::memory_order_acquire) == t)
+            return nullptr;
+        return &items[t & mask];
+    }
+
+    // Consumer side. Copies up to max items to out and returns the number copied.
+    uint32_t Pop(T *out, uint32_t max)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t available = head.load(std::memory_order_acquire) - t;
+        uint32_t count = available < max ? available : max;
+
+        for (uint32_t i = 0; i < count; i++)
+            out[i] = items[(t + i) & mask];
+
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,141 @@
+/*
+NMEA2000_esp32_scheduler.cpp
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NMEA2000_esp32_scheduler.h"
+#include <string.h>
+
+#define QUEUE_MASK (ESP32_CAN_TX_SCHEDULER_QUEUE_LEN - 1)
+
+static_assert((ESP32_CAN_TX_SCHEDULER_QUEUE_LEN & QUEUE_MASK) == 0, "ESP32_CAN_TX_SCHEDULER_QUEUE_LEN must be a power of two");
+
+//*****************************************************************************
+bool tCANTxScheduler::Push(const tCANTxEntry &entry)
+{
+    int prio = Priority(entry.id);
+    tQueue &queue = queues[prio];
+
+    if (queue.count == ESP32_CAN_TX_SCHEDULER_QUEUE_LEN)
+    {
+        overflows++;
+        return false;
+    }
+
+    queue.entries[(queue.head + queue.count) & QUEUE_MASK] = entry;
+    queue.count++;
+    non_empty |= 1UL << prio;
+    count++;
+
+    return true;
+}
+
+//*****************************************************************************
+bool tCANTxScheduler::Replace(const tCANTxEntry &entry)
+{
+    tQueue &queue = queues[Priority(entry.id)];
+
+    for (uint32_t i = 0; i < queue.count; i++)
+    {
+        tCANTxEntry &waiting = queue.entries[(queue.head + i) & QUEUE_MASK];
+
+        if (waiting.id == entry.id)
+        {
+            // Keep enqueued, the latency is that of the place in the queue
+            waiting.len = entry.len;
+            memcpy(waiting.data, entry.data, entry.len);
+            replaced++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//*****************************************************************************
+const tCANTxEntry *tCANTxScheduler::Front() const
+{
+    if (non_empty == 0)
+        return nullptr;
+
+    const tQueue &queue = queues[__builtin_ctz(non_empty)];
+    return &queue.entries[queue.head];
+}
+
+//*****************************************************************************
+void tCANTxScheduler::PopFront(int64_t now)
+{
+    if (non_empty == 0)
+        return;
+
+    int prio = __builtin_ctz(non_empty);
+    tQueue &queue = queues[prio];
+    tLatency &stats = latency[prio];
+    uint32_t waited = now > queue.entries[queue.head].enqueued ? (uint32_t)(now - queue.entries[queue.head].enqueued) : 0;
+
+    stats.Count++;
+    stats.TotalUs += waited;
+    if (waited > stats.MaxUs)
+        stats.MaxUs = waited;
+
+    queue.head = (queue.head + 1) & QUEUE_MASK;
+    queue.count--;
+    if (queue.count == 0)
+        non_empty &= ~(1UL << prio);
+    count--;
+}
+
+//*****************************************************************************
+uint32_t tCANTxScheduler::Expire(int64_t now, const uint32_t *max_age_us)
+{
+    uint32_t expired = 0;
+
+    for (int prio = 0; prio < PRIORITIES; prio++)
+    {
+        tQueue &queue = queues[prio];
+
+        // Each queue is in the order frames were scheduled, the oldest is at head
+        while (queue.count > 0 && max_age_us[prio] != 0 && now - queue.entries[queue.head].enqueued >= max_age_us[prio])
+        {
+            queue.head = (queue.head + 1) & QUEUE_MASK;
+            queue.count--;
+            count--;
+            expired++;
+        }
+
+        if (queue.count == 0)
+            non_empty &= ~(1UL << prio);
+    }
+
+    return expired;
+}
+
+//*****************************************************************************
+void tCANTxScheduler::Clear()
+{
+    for (tQueue &queue : queues)
+    {
+        queue.head = 0;
+        queue.count = 0;
+    }
+    non_empty = 0;
+    count = 0;
+}
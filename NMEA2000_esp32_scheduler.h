@@ -0,0 +1,118 @@
+/*
+NMEA2000_esp32_scheduler.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Software TX stage ordered by NMEA 2000 priority.
+
+The TWAI TX queue is first in, first out, so a high priority frame queued behind
+low priority frames waits for all of them even though it would win arbitration.
+tCANTxScheduler keeps one FIFO per priority (ID[28:26], 0 is highest) and hands
+out the oldest frame of the highest priority. The driver keeps only a frame or
+two in the TWAI queue and refills it from here as frames complete, so a new
+frame overtakes everything of lower priority that is still waiting here.
+
+Replace gives a frame latest-value semantics: it overwrites the data of a
+waiting frame with the same CAN id, which keeps its place in the queue, so a
+periodic PGN never has more than one frame waiting and the one sent carries the
+newest value.
+
+The scheduler is not thread safe, the driver serialises access to it.
+*/
+
+#ifndef _NMEA2000_ESP32_SCHEDULER_H_
+#define _NMEA2000_ESP32_SCHEDULER_H_
+
+#include <stdint.h>
+
+// Frames waiting per priority, a power of two
+#ifndef ESP32_CAN_TX_SCHEDULER_QUEUE_LEN
+#define ESP32_CAN_TX_SCHEDULER_QUEUE_LEN 16
+#endif
+
+struct tCANTxEntry
+{
+    unsigned long id;
+    unsigned char len;
+    unsigned char data[8];
+    int64_t enqueued; // esp_timer_get_time() when scheduled
+};
+
+class tCANTxScheduler
+{
+  public:
+    static const int PRIORITIES = 8;
+
+    // Time from scheduling a frame to handing it to the TWAI driver, the time it
+    // spent waiting behind other frames
+    struct tLatency
+    {
+        uint32_t Count;
+        uint32_t MaxUs;
+        uint64_t TotalUs;
+
+        uint32_t MeanUs() const { return Count != 0 ? (uint32_t)(TotalUs / Count) : 0; }
+    };
+
+  private:
+    struct tQueue
+    {
+        tCANTxEntry entries[ESP32_CAN_TX_SCHEDULER_QUEUE_LEN];
+        uint32_t head;
+        uint32_t count;
+    };
+
+    tQueue queues[PRIORITIES] = {};
+    uint32_t non_empty = 0; // Bit n set when queues[n] holds frames
+    uint32_t count = 0;
+
+    tLatency latency[PRIORITIES] = {};
+    uint32_t overflows = 0;
+    uint32_t replaced = 0;
+
+  public:
+    static int Priority(unsigned long id) { return (id >> 26) & 0x7; }
+
+    // Fails and counts an overflow when the queue of the frame's priority is full
+    bool Push(const tCANTxEntry &entry);
+    // Overwrite the waiting frame with the id of entry. Returns false if there is none.
+    bool Replace(const tCANTxEntry &entry);
+    uint32_t Free(int prio) const { return ESP32_CAN_TX_SCHEDULER_QUEUE_LEN - queues[prio].count; }
+    // For frames refused before Push, e.g. a message that does not fit as a whole
+    void CountOverflows(uint32_t frames) { overflows += frames; }
+
+    // Oldest frame of the highest priority, nullptr when empty. PopFront removes it
+    // and records its latency.
+    const tCANTxEntry *Front() const;
+    void PopFront(int64_t now);
+
+    // Drop the frames that have waited max_age_us[priority] or longer, 0 for no
+    // limit, and return how many were dropped
+    uint32_t Expire(int64_t now, const uint32_t *max_age_us);
+
+    void Clear();
+
+    uint32_t Count() const { return count; }
+    uint32_t GetOverflows() const { return overflows; }
+    uint32_t GetReplaced() const { return replaced; }
+    const tLatency &GetLatency(int prio) const { return latency[prio]; }
+};
+
+#endif
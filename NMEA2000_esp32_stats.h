@@ -0,0 +1,172 @@
+/*
+NMEA2000_esp32_stats.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Building blocks for the driver statistics.
+
+tSeqLock publishes a small struct from one writer to any number of readers on
+any task or core without locks: the writer makes the sequence odd while it
+updates, and a reader retries when the sequence was odd or changed under it.
+
+tCANRateAverage turns per-second counts into rates over 1, 10 and 60 seconds
+with integer fixed-point exponential averages, like the Unix load average, so
+that the timer callback does no floating point.
+*/
+
+#ifndef _NMEA2000_ESP32_STATS_H_
+#define _NMEA2000_ESP32_STATS_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+template <typename T>
+class tSeqLock
+{
+  private:
+    static const int WORDS = (sizeof(T) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint32_t> words[WORDS] = {};
+
+  public:
+    // Single writer
+    void Write(const T &value)
+    {
+        uint32_t buffer[WORDS] = {};
+        memcpy(buffer, &value, sizeof(T));
+
+        uint32_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (int i = 0; i < WORDS; i++)
+            words[i].store(buffer[i], std::memory_order_relaxed);
+
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    T Read() const
+    {
+        uint32_t buffer[WORDS];
+        uint32_t seq;
+
+        do
+        {
+            seq = sequence.load(std::memory_order_acquire);
+
+            for (int i = 0; i < WORDS; i++)
+                buffer[i] = words[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((seq & 1) != 0 || seq != sequence.load(std::memory_order_relaxed));
+
+        T value;
+        memcpy(&value, buffer, sizeof(T));
+        return value;
+    }
+};
+
+struct tCANRate
+{
+    uint32_t Last1s;
+    uint32_t Avg10s;
+    uint32_t Avg60s;
+};
+
+class tCANRateAverage
+{
+  private:
+    // exp(-1/10) and exp(-1/60) in 16 bit fixed point, for one update per second
+    static const uint64_t FIXED_SHIFT = 16;
+    static const uint64_t FIXED_1 = 1ULL << FIXED_SHIFT;
+    static const uint64_t EXP_10S = 59299;
+    static const uint64_t EXP_60S = 64453;
+
+    uint32_t last = 0;
+    uint64_t avg_10s = 0;
+    uint64_t avg_60s = 0;
+
+    static uint64_t Decay(uint64_t avg, uint64_t exp, uint32_t count)
+    {
+        return (avg * exp + ((uint64_t)count << FIXED_SHIFT) * (FIXED_1 - exp)) >> FIXED_SHIFT;
+    }
+
+  public:
+    // count is what happened in the last second
+    void Update(uint32_t count)
+    {
+        last = count;
+        avg_10s = Decay(avg_10s, EXP_10S, count);
+        avg_60s = Decay(avg_60s, EXP_60S, count);
+    }
+
+    tCANRate Get() const
+    {
+        return {last, (uint32_t)((avg_10s + FIXED_1 / 2) >> FIXED_SHIFT), (uint32_t)((avg_60s + FIXED_1 / 2) >> FIXED_SHIFT)};
+    }
+};
+
+// Totals count since CANOpen and wrap around, rates are per second
+struct tCANStatistics
+{
+    uint32_t Seconds;
+
+    uint32_t RxPackets;
+    uint32_t RxBits;
+    uint32_t TxPackets;
+    uint32_t TxBits;
+    uint32_t AlertWakeups;
+
+    tCANRate RxPacketsPerSecond;
+    tCANRate RxBitsPerSecond;
+    tCANRate TxPacketsPerSecond;
+    tCANRate TxBitsPerSecond;
+    tCANRate AlertWakeupsPerSecond;
+
+    // Bus utilisation in hundredths of a percent of 250 kbit/s. Bits are exact
+    // stuffed frame lengths including the interframe space, see CANFrameBits.
+    tCANRate BusLoad;
+
+    // TWAI controller error and loss counters from twai_get_status_info, totals
+    // since the driver was installed
+    uint32_t TxFailed;
+    uint32_t RxMissed;  // RX queue full
+    uint32_t RxOverrun; // Controller RX FIFO overrun
+    uint32_t ArbLost;
+    uint32_t BusErrors;
+    uint32_t RxRingOverflows; // RX task ring full
+
+    tCANRate TxFailedPerSecond;
+    tCANRate RxMissedPerSecond;
+    tCANRate RxOverrunPerSecond;
+    tCANRate ArbLostPerSecond;
+    tCANRate BusErrorsPerSecond;
+    tCANRate RxRingOverflowsPerSecond;
+
+    // Error counters now and their change over the last second
+    uint32_t TxErrorCounter;
+    uint32_t RxErrorCounter;
+    int32_t TxErrorSlope;
+    int32_t RxErrorSlope;
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+NMEA2000_esp32_trace.cpp
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NMEA2000_esp32_trace.h"
+#include <stdio.h>
+
+//*****************************************************************************
+int CANTraceFormat(const tCANTraceRecord &record, const char *tag, char *line, size_t size)
+{
+    static const char *const Events[] = {"CANSendFrame", "CANSendFrames", "CANGetFrame"};
+
+    // Same decoding as tNMEA2000_esp32::canIdToN2k
+    unsigned char pf = (unsigned char)(record.Id >> 16);
+    unsigned char ps = (unsigned char)(record.Id >> 8);
+    unsigned long pgn = ((record.Id >> 24) & 1) << 16 | (unsigned long)pf << 8;
+    int prio = (record.Id >> 26) & 0x7;
+    int src = record.Id & 0xFF;
+    int dst = 0xFF;
+
+    if (pf < 240)
+        dst = ps;
+    else
+        pgn |= ps;
+
+    const char *event = record.Event < sizeof(Events) / sizeof(Events[0]) ? Events[record.Event] : "CANTraceUnknown";
+
+    // ESP_LOGI with the default log format
+    return snprintf(line, size, "I (%u) %s: %s Len = %d, Prio = %d, PGN = %ld, Src = %d, Dst = %d", (unsigned)(record.Timestamp / 1000), tag,
+                    event, record.Len, prio, pgn, src, dst);
+}
+
+//*****************************************************************************
+uint32_t tCANTrace::Read(tCANTraceRecord *records, uint32_t max)
+{
+    uint32_t written = head.load(std::memory_order_acquire);
+    uint32_t count = 0;
+
+    // Records older than the ring are gone
+    if (written - tail > ESP32_CAN_TRACE_RECORDS)
+    {
+        lost.fetch_add(written - tail - ESP32_CAN_TRACE_RECORDS, std::memory_order_relaxed);
+        tail = written - ESP32_CAN_TRACE_RECORDS;
+    }
+
+    while (tail != written && count < max)
+    {
+        const tSlot &slot = slots[tail & MASK];
+        uint32_t sequence = slot.Sequence.load(std::memory_order_acquire);
+
+        // Still being written, try again on the next call
+        if (sequence == 0 || (int32_t)(sequence - (tail + 1)) < 0)
+            break;
+
+        uint32_t words[4];
+        for (int i = 0; i < 4; i++)
+            words[i] = slot.Words[i].load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (sequence != tail + 1 || slot.Sequence.load(std::memory_order_relaxed) != sequence)
+        {
+            // Overwritten by a newer record
+            lost.fetch_add(1, std::memory_order_relaxed);
+            tail++;
+            continue;
+        }
+
+        tCANTraceRecord &record = records[count++];
+        record.Timestamp = (int64_t)((uint64_t)words[1] << 32 | words[0]);
+        record.Id = words[2];
+        record.Len = words[3] & 0xFF;
+        record.Event = (words[3] >> 8) & 0xFF;
+        record.Reserved[0] = record.Reserved[1] = 0;
+        tail++;
+    }
+
+    return count;
+}
@@ -0,0 +1,116 @@
+/*
+NMEA2000_esp32_trace.h
+
+Copyright (c) 2022 Karl Andersson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Binary trace of the frame path.
+
+With ESP32_CAN_TRACE the driver does not format the per-frame INFO lines
+("CANSendFrame Len = ..."). It writes a fixed size record with the time, CAN id,
+length and event into a ring instead, which costs a timer read and a few stores.
+The ring keeps the newest records and overwrites the oldest. Any task may write;
+one task drains it with Read and ships the records off the node as raw bytes,
+where CANTraceFormat, or the host tool nmea2000_esp32_trace_decode, turns them
+back into the lines ESP_LOGI would have printed.
+
+Each slot carries the sequence number of the record in it. A writer clears it,
+stores the record and then publishes the number, so the reader can tell a
+complete record from one being written or overwritten while it copied it.
+*/
+
+#ifndef _NMEA2000_ESP32_TRACE_H_
+#define _NMEA2000_ESP32_TRACE_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Records kept, a power of two. Each takes 20 bytes.
+#ifndef ESP32_CAN_TRACE_RECORDS
+#define ESP32_CAN_TRACE_RECORDS 512
+#endif
+
+enum tCANTraceEvent : uint8_t
+{
+    CANTraceSendFrame,  // CANSendFrame
+    CANTraceSendFrames, // One frame of CANSendFrames
+    CANTraceGetFrame    // One frame returned by CANGetFrame or CANGetFrames
+};
+
+// The exported format: 16 bytes, little endian as on the ESP32
+struct tCANTraceRecord
+{
+    int64_t Timestamp; // esp_timer_get_time()
+    uint32_t Id;
+    uint8_t Len;
+    uint8_t Event; // tCANTraceEvent
+    uint8_t Reserved[2];
+};
+
+static_assert(sizeof(tCANTraceRecord) == 16, "tCANTraceRecord is an exported format");
+
+// Format one record the way the driver logs the event, without the trailing newline.
+// Returns the length snprintf returned.
+int CANTraceFormat(const tCANTraceRecord &record, const char *tag, char *line, size_t size);
+
+class tCANTrace
+{
+  private:
+    static const uint32_t MASK = ESP32_CAN_TRACE_RECORDS - 1;
+
+    static_assert((ESP32_CAN_TRACE_RECORDS & MASK) == 0, "ESP32_CAN_TRACE_RECORDS must be a power of two");
+
+    struct tSlot
+    {
+        std::atomic<uint32_t> Sequence{0}; // Record number + 1, 0 while being written
+        std::atomic<uint32_t> Words[4];
+    };
+
+    tSlot slots[ESP32_CAN_TRACE_RECORDS];
+    std::atomic<uint32_t> head{0}; // Records ever written
+    uint32_t tail = 0;             // Next record to read, owned by the reader
+    std::atomic<uint32_t> lost{0};
+
+  public:
+    void Record(int64_t timestamp, unsigned long id, unsigned char len, tCANTraceEvent event)
+    {
+        uint32_t number = head.fetch_add(1, std::memory_order_relaxed);
+        tSlot &slot = slots[number & MASK];
+
+        slot.Sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.Words[0].store((uint32_t)timestamp, std::memory_order_relaxed);
+        slot.Words[1].store((uint32_t)((uint64_t)timestamp >> 32), std::memory_order_relaxed);
+        slot.Words[2].store((uint32_t)id, std::memory_order_relaxed);
+        slot.Words[3].store((uint32_t)len | ((uint32_t)event << 8), std::memory_order_relaxed);
+
+        slot.Sequence.store(number + 1, std::memory_order_release);
+    }
+
+    // Copy up to max of the oldest unread records to records and return the number
+    // copied. Call from one task at a time.
+    uint32_t Read(tCANTraceRecord *records, uint32_t max);
+
+    // Records overwritten before they were read
+    uint32_t GetLost() const { return lost.load(std::memory_order_relaxed); }
+};
+
+#endif
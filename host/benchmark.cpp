@@ -0,0 +1,349 @@
+/*
+benchmark.cpp
+
+Per-frame cost of the tNMEA2000_esp32 hot paths on the host emulation.
+
+Every call is timed individually and the median and mean are reported in
+nanoseconds and in time stamp counter cycles, after subtracting the cost of
+the timing itself. Batched calls are reported per frame. Untimed work between
+the calls puts the driver in the state the case describes (TX queue empty or
+nearly full, RX queue filled).
+
+Log output is sent to a sink that formats into a buffer and discards it, so
+the INFO cases include the formatting cost but not the terminal.
+*/
+
+#include "NMEA2000_esp32.h"
+#include "NMEA2000_esp32_framelen.h"
+#include "NMEA2000_esp32_histogram.h"
+#include "NMEA2000_esp32_trace.h"
+#include "esp_timer.h"
+#include "twai_host.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#else
+#define BENCH_HAVE_TSC 0
+#endif
+
+#define BENCH_SAMPLES 20000
+#define BENCH_TX_QUEUE_LEN 32
+#define BENCH_RX_QUEUE_LEN 32
+#define BENCH_FAST_PACKET_FRAMES 4
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct tSample
+    {
+        uint64_t ns;
+        uint64_t cycles;
+    };
+
+    struct tTimer
+    {
+        Clock::time_point t0;
+        uint64_t c0;
+
+        inline void Start()
+        {
+            t0 = Clock::now();
+#if BENCH_HAVE_TSC
+            c0 = __rdtsc();
+#endif
+        }
+
+        inline tSample Stop()
+        {
+            tSample s;
+#if BENCH_HAVE_TSC
+            s.cycles = __rdtsc() - c0;
+#else
+            s.cycles = 0;
+#endif
+            s.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+            return s;
+        }
+    };
+
+    tSample timer_overhead;
+
+    int null_vprintf(const char *format, va_list args)
+    {
+        char line[256];
+        return vsnprintf(line, sizeof(line), format, args);
+    }
+
+    uint64_t median(std::vector<uint64_t> &v)
+    {
+        std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+        return v[v.size() / 2];
+    }
+
+    void report(const char *name, std::vector<tSample> &samples, int frames_per_call)
+    {
+        std::vector<uint64_t> ns, cycles;
+        uint64_t ns_sum = 0, cycles_sum = 0;
+
+        for (const tSample &s : samples)
+        {
+            uint64_t n = (s.ns > timer_overhead.ns ? s.ns - timer_overhead.ns : 0) / frames_per_call;
+            uint64_t c = (s.cycles > timer_overhead.cycles ? s.cycles - timer_overhead.cycles : 0) / frames_per_call;
+            ns.push_back(n);
+            cycles.push_back(c);
+            ns_sum += n;
+            cycles_sum += c;
+        }
+
+        printf("%-52s %8llu %8llu %10llu %10llu\n", name, (unsigned long long)median(ns), (unsigned long long)(ns_sum / samples.size()),
+               (unsigned long long)median(cycles), (unsigned long long)(cycles_sum / samples.size()));
+    }
+
+    template <typename Prepare, typename Call>
+    void run(const char *name, Prepare prepare, Call call, int frames_per_call = 1)
+    {
+        std::vector<tSample> samples;
+        samples.reserve(BENCH_SAMPLES);
+
+        for (int i = 0; i < BENCH_SAMPLES; i++)
+        {
+            prepare(i);
+            tTimer t;
+            t.Start();
+            call();
+            samples.push_back(t.Stop());
+        }
+        report(name, samples, frames_per_call);
+    }
+
+    void calibrate()
+    {
+        std::vector<uint64_t> ns, cycles;
+        for (int i = 0; i < BENCH_SAMPLES; i++)
+        {
+            tTimer t;
+            t.Start();
+            tSample s = t.Stop();
+            ns.push_back(s.ns);
+            cycles.push_back(s.cycles);
+        }
+        timer_overhead.ns = median(ns);
+        timer_overhead.cycles = median(cycles);
+    }
+
+    twai_message_t remote_frame(uint32_t id)
+    {
+        twai_message_t message;
+        memset(&message, 0, sizeof(message));
+        message.extd = 1;
+        message.identifier = id;
+        message.data_length_code = 8;
+        for (int i = 0; i < 8; i++)
+            message.data[i] = (uint8_t)(i * 17);
+        return message;
+    }
+
+    // Leave msgs_to_tx at the TX queue length: the hardware buffer plus all but one queue slot
+    void fill_tx_queue(tNMEA2000_esp32 &n2k, const unsigned char *data)
+    {
+        twai_status_info_t status;
+        twai_get_status_info(&status);
+        while (status.msgs_to_tx < BENCH_TX_QUEUE_LEN)
+        {
+            n2k.CANSendFrame(0x19F01200, 8, data, false);
+            twai_get_status_info(&status);
+        }
+    }
+
+    void bench_send(tNMEA2000_esp32 &n2k, const char *level)
+    {
+        const unsigned char data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+        char name[96];
+
+        for (int wait_sent = 0; wait_sent <= 1; wait_sent++)
+        {
+            twai_host_set_bus_hold(false);
+            snprintf(name, sizeof(name), "CANSendFrame log=%s wait_sent=%d queue=empty", level, wait_sent);
+            run(
+                name, [](int) { twai_host_wait_idle(1000); }, [&] { n2k.CANSendFrame(0x09F80100, 8, data, wait_sent); });
+
+            twai_host_set_bus_hold(true);
+            snprintf(name, sizeof(name), "CANSendFrame log=%s wait_sent=%d queue=nearly full", level, wait_sent);
+            run(
+                name,
+                [&](int) {
+                    twai_clear_transmit_queue();
+                    fill_tx_queue(n2k, data);
+                },
+                [&] { n2k.CANSendFrame(0x09F80100, 8, data, wait_sent); });
+            twai_clear_transmit_queue();
+            twai_host_set_bus_hold(false);
+            twai_host_wait_idle(1000);
+        }
+
+        // A four frame fast packet, one call per frame against one call per message
+        tNMEA2000_esp32::tFrame frames[BENCH_FAST_PACKET_FRAMES];
+        for (int i = 0; i < BENCH_FAST_PACKET_FRAMES; i++)
+        {
+            frames[i].id = 0x19F80500;
+            frames[i].len = 8;
+            memcpy(frames[i].data, data, 8);
+            frames[i].data[0] = (unsigned char)i;
+        }
+
+        twai_host_set_bus_hold(true);
+        snprintf(name, sizeof(name), "CANSendFrame log=%s x%d (per frame)", level, BENCH_FAST_PACKET_FRAMES);
+        run(
+            name, [](int) { twai_clear_transmit_queue(); },
+            [&] {
+                for (int i = 0; i < BENCH_FAST_PACKET_FRAMES; i++)
+                    n2k.CANSendFrame(frames[i].id, frames[i].len, frames[i].data, false);
+            },
+            BENCH_FAST_PACKET_FRAMES);
+        snprintf(name, sizeof(name), "CANSendFrames log=%s x%d (per frame)", level, BENCH_FAST_PACKET_FRAMES);
+        run(
+            name, [](int) { twai_clear_transmit_queue(); }, [&] { n2k.CANSendFrames(frames, BENCH_FAST_PACKET_FRAMES, false); },
+            BENCH_FAST_PACKET_FRAMES);
+        twai_clear_transmit_queue();
+        twai_host_set_bus_hold(false);
+        twai_host_wait_idle(1000);
+    }
+
+    void bench_receive(tNMEA2000_esp32 &n2k, const char *level)
+    {
+        twai_message_t message = remote_frame(0x09F10D22);
+        unsigned long id;
+        unsigned char len;
+        unsigned char buf[8];
+        char name[96];
+
+        snprintf(name, sizeof(name), "CANGetFrame log=%s queue=filled", level);
+        run(
+            name,
+            [&](int i) {
+                if (i % BENCH_RX_QUEUE_LEN == 0)
+                {
+                    for (int k = 0; k < BENCH_RX_QUEUE_LEN; k++)
+                        twai_host_inject(&message);
+                }
+            },
+            [&] { n2k.CANGetFrame(id, len, buf); });
+
+        while (n2k.CANGetFrame(id, len, buf))
+            ;
+
+        snprintf(name, sizeof(name), "CANGetFrame log=%s queue=empty", level);
+        run(
+            name, [](int) {}, [&] { n2k.CANGetFrame(id, len, buf); });
+
+        tNMEA2000_esp32::tFrame frames[BENCH_RX_QUEUE_LEN];
+
+        snprintf(name, sizeof(name), "CANGetFrames log=%s batch=%d (per frame)", level, BENCH_RX_QUEUE_LEN);
+        run(
+            name,
+            [&](int) {
+                for (int k = 0; k < BENCH_RX_QUEUE_LEN; k++)
+                    twai_host_inject(&message);
+            },
+            [&] { n2k.CANGetFrames(frames, BENCH_RX_QUEUE_LEN); }, BENCH_RX_QUEUE_LEN);
+    }
+
+    // The calls the hot paths make on every frame, timed on their own
+    void bench_components()
+    {
+        twai_status_info_t status_info;
+        twai_message_t message;
+        const unsigned char data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+        volatile esp_log_level_t level;
+
+        run(
+            "  twai_get_status_info", [](int) {}, [&] { twai_get_status_info(&status_info); });
+        run(
+            "  esp_log_level_get", [](int) {}, [&] { level = esp_log_level_get("NMEA2000_esp32"); });
+        static std::atomic<bool> frame_logging{false};
+        volatile bool logging;
+        run(
+            "  cached frame logging flag", [](int) {}, [&] { logging = frame_logging.load(std::memory_order_relaxed); });
+        (void)logging;
+        run(
+            "  memset + memcpy of twai_message_t", [](int) {},
+            [&] {
+                memset(&message, 0, sizeof(message));
+                memcpy(message.data, data, 8);
+                asm volatile("" : : "r"(&message) : "memory");
+            });
+        (void)level;
+
+        // Statistics cost per frame, the exact stuffed length against the old estimate
+        volatile uint32_t bits;
+        unsigned char len = 8;
+        asm volatile("" : "+r"(len));
+        run(
+            "  CANFrameBits len=8", [](int) {}, [&] { bits = CANFrameBits(0x09F80100, len, data); });
+        run(
+            "  CANFrameBits len=0", [](int) {}, [&] { bits = CANFrameBits(0x09F80100, 0, data); });
+        run(
+            "  52 + len * 8 estimate", [](int) {}, [&] { bits = 52 + len * 8; });
+        (void)bits;
+
+        // Latency recording cost per sample, a clock read and a histogram record
+        static tLatencyHistogram histogram;
+        volatile int64_t now;
+        run(
+            "  esp_timer_get_time", [](int) {}, [&] { now = esp_timer_get_time(); });
+        run(
+            "  tLatencyHistogram::Record", [](int) {}, [&] { histogram.Record(now & 0xFFFF); });
+
+        // A binary trace record against formatting the line it stands for
+        static tCANTrace trace;
+        tCANTraceRecord record = {0, 0x09F80100, 8, CANTraceSendFrame, {0, 0}};
+        char line[128];
+        run(
+            "  tCANTrace::Record", [](int) {}, [&] { trace.Record(esp_timer_get_time(), 0x09F80100, len, CANTraceSendFrame); });
+        run(
+            "  CANTraceFormat", [](int) {}, [&] { bits = CANTraceFormat(record, "NMEA2000_esp32", line, sizeof(line)); });
+        (void)bits;
+    }
+}
+
+int main()
+{
+    esp_log_set_vprintf(null_vprintf);
+    calibrate();
+
+    tNMEA2000_esp32 n2k;
+    n2k.CANOpen();
+
+    printf("NMEA2000_esp32 host benchmark, ESP32_CAN_STATISTICS=%d, ESP32_CAN_TRACE=%d, %d samples per case\n", ESP32_CAN_STATISTICS,
+           ESP32_CAN_TRACE, BENCH_SAMPLES);
+    printf("timer overhead subtracted: %llu ns, %llu cycles%s\n\n", (unsigned long long)timer_overhead.ns,
+           (unsigned long long)timer_overhead.cycles, BENCH_HAVE_TSC ? "" : " (no TSC on this target)");
+    printf("%-52s %8s %8s %10s %10s\n", "case", "med ns", "mean ns", "med cyc", "mean cyc");
+
+    const struct
+    {
+        const char *name;
+        esp_log_level_t level;
+    } levels[] = {{"WARN", ESP_LOG_WARN}, {"INFO", ESP_LOG_INFO}};
+
+    for (const auto &l : levels)
+    {
+        n2k.SetLogLevel(l.level);
+        bench_send(n2k, l.name);
+        bench_receive(n2k, l.name);
+    }
+
+    n2k.SetLogLevel(ESP_LOG_WARN);
+    printf("\nper-frame calls inside the hot paths\n");
+    bench_components();
+
+    return 0;
+}
@@ -0,0 +1,213 @@
+/*
+benchmark_sniffer.cpp
+
+Capture headroom of the listen-only sniffer build (ESP32_CAN_LISTEN_ONLY) on the
+host emulation.
+
+Other nodes keep the bus 100% loaded: every frame of a run is injected up front,
+so the bus thread puts them on the wire back to back. The application loop
+drains the driver with CANGetFrames until it is empty and then stalls, the way
+a loop that writes to a card or a socket does. Every frame put on the wire must
+come out of CANGetFrames, in order, with rx_missed_count, rx_overrun_count and
+the RX ring overflows unchanged.
+
+The first run is at 250 kbit/s. The bit rate is then doubled until frames are
+lost; the highest multiple without loss is the headroom of the receive path,
+with the given stall, on this host. The figures are host figures; use them to
+compare changes, not as ESP32 timings.
+
+  nmea2000_esp32_benchmark_sniffer [stall ms, default 20] [seconds per run, default 2]
+*/
+
+#include "NMEA2000_esp32.h"
+#include "NMEA2000_esp32_framelen.h"
+#include "esp_timer.h"
+#include "twai_host.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#if ESP32_CAN_LISTEN_ONLY != 1
+#error "Build with ESP32_CAN_LISTEN_ONLY set to 1"
+#endif
+
+#define BENCH_BITRATE 250000
+#define BENCH_MAX_MULTIPLE 64
+#define BENCH_BATCH 32
+
+namespace
+{
+    int null_vprintf(const char *format, va_list args)
+    {
+        char line[256];
+        return vsnprintf(line, sizeof(line), format, args);
+    }
+
+    uint32_t xorshift(uint32_t &state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    // A typical mix: rapid position, heading, COG/SOG, rudder, wind, engine and
+    // fast packet GNSS frames from a handful of sources
+    const unsigned long Ids[] = {0x09F80100, 0x09F11205, 0x09F80210, 0x09F10D03, 0x09FD0211, 0x09F20020, 0x0DF80501};
+
+    struct tRun
+    {
+        uint64_t bits = 0;
+        uint32_t frames = 0;
+        uint32_t received = 0;
+        uint32_t out_of_order = 0;
+        uint32_t missed = 0;
+        uint32_t overrun = 0;
+        uint32_t overflows = 0;
+        int64_t first = 0;
+        int64_t last = 0;
+        uint64_t last_bits = 0; // Bits from the first received frame to the last
+    };
+
+    void status(uint32_t &missed, uint32_t &overrun)
+    {
+        twai_status_info_t status_info;
+        twai_get_status_info(&status_info);
+        missed = status_info.rx_missed_count;
+        overrun = status_info.rx_overrun_count;
+    }
+
+    tRun run(tNMEA2000_esp32 &n2k, uint32_t bitrate, uint32_t seconds, uint32_t stall_ms, uint32_t &sequence)
+    {
+        tRun result;
+        std::vector<twai_message_t> messages;
+        std::vector<uint32_t> bits;
+        uint32_t seed = 0x12345678 ^ bitrate;
+        uint32_t first_sequence = sequence;
+
+        // Frames to keep the bus busy for seconds, a sequence number in the first four bytes
+        while (result.bits < (uint64_t)bitrate * seconds)
+        {
+            twai_message_t message;
+            memset(&message, 0, sizeof(message));
+            message.extd = 1;
+            message.identifier = Ids[xorshift(seed) % (sizeof(Ids) / sizeof(Ids[0]))];
+            message.data_length_code = 8;
+            memcpy(message.data, &sequence, 4);
+            uint32_t random = xorshift(seed);
+            memcpy(message.data + 4, &random, 4);
+            sequence++;
+
+            bits.push_back(CANFrameBits(message.identifier, message.data_length_code, message.data));
+            result.bits += bits.back();
+            messages.push_back(message);
+        }
+        result.frames = messages.size();
+
+        uint32_t missed, overrun, overflows = n2k.GetRxRingOverflows();
+        status(missed, overrun);
+
+        twai_host_set_bitrate(bitrate);
+        for (const twai_message_t &message : messages)
+            twai_host_inject(&message);
+
+        std::atomic<bool> idle{false};
+        std::thread waiter([&idle, seconds] {
+            twai_host_wait_idle(seconds * 4000 + 1000);
+            idle = true;
+        });
+
+        // The application loop, then what the RX task and the ring still hold
+        tNMEA2000_esp32::tFrame frames[BENCH_BATCH];
+        uint32_t expected = first_sequence;
+        int empty = 0;
+
+        while (!idle || empty < 3)
+        {
+            int count;
+            bool any = false;
+
+            while ((count = n2k.CANGetFrames(frames, BENCH_BATCH)) > 0)
+            {
+                any = true;
+                for (int i = 0; i < count; i++)
+                {
+                    uint32_t got;
+                    memcpy(&got, frames[i].data, 4);
+
+                    if (result.received == 0)
+                        result.first = frames[i].timestamp;
+                    else if (got - first_sequence < bits.size())
+                        result.last_bits += bits[got - first_sequence];
+                    result.last = frames[i].timestamp;
+
+                    if (got != expected)
+                        result.out_of_order++;
+                    expected = got + 1;
+                    result.received++;
+                }
+            }
+
+            empty = idle && !any ? empty + 1 : 0;
+            vTaskDelay(pdMS_TO_TICKS(idle ? 1 : stall_ms));
+        }
+        waiter.join();
+
+        uint32_t missed_now, overrun_now;
+        status(missed_now, overrun_now);
+        result.missed = missed_now - missed;
+        result.overrun = overrun_now - overrun;
+        result.overflows = n2k.GetRxRingOverflows() - overflows;
+
+        return result;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t stall_ms = argc > 1 ? atoi(argv[1]) : 20;
+    uint32_t seconds = argc > 2 ? atoi(argv[2]) : 2;
+
+    esp_log_set_vprintf(null_vprintf);
+
+    tNMEA2000_esp32 n2k;
+    n2k.CANOpen();
+
+    printf("NMEA2000_esp32 sniffer benchmark, RX queue %d, RX ring %d, application loop stalls %u ms, %u s per run\n\n",
+           ESP32_CAN_RX_QUEUE_LEN, ESP32_CAN_RX_RING_SIZE, (unsigned)stall_ms, (unsigned)seconds);
+    printf("%8s %8s %8s %8s %8s %8s %8s %8s %8s %10s %10s\n", "kbit/s", "load %", "frames", "received", "order", "missed", "overrun",
+           "ring ovf", "ring max", "ts err us", "verdict");
+
+    uint32_t sequence = 0;
+    int headroom = 0;
+
+    for (int multiple = 1; multiple <= BENCH_MAX_MULTIPLE; multiple *= 2)
+    {
+        uint32_t bitrate = BENCH_BITRATE * multiple;
+        tRun result = run(n2k, bitrate, seconds, stall_ms, sequence);
+
+        double span = (double)(result.last - result.first) / 1e6;
+        double load = span > 0 ? 100.0 * result.last_bits / (span * bitrate) : 0;
+        bool clean = result.received == result.frames && result.out_of_order == 0 && result.missed == 0 && result.overrun == 0 &&
+                     result.overflows == 0;
+
+        // Ring high water and timestamp error are the highest seen so far
+        printf("%8u %8.1f %8u %8u %8u %8u %8u %8u %8u %10u %10s\n", (unsigned)(bitrate / 1000), load, (unsigned)result.frames,
+               (unsigned)result.received, (unsigned)result.out_of_order, (unsigned)result.missed, (unsigned)result.overrun,
+               (unsigned)result.overflows, (unsigned)n2k.GetRxRingHighWater(), (unsigned)n2k.GetRxTimestampErrorMax(),
+               clean ? "no loss" : "LOSS");
+
+        if (!clean)
+            break;
+        headroom = multiple;
+    }
+
+    printf("\nheadroom: %dx the frame rate of a 100%% loaded 250 kbit/s bus%s\n", headroom,
+           headroom == BENCH_MAX_MULTIPLE ? " or more" : "");
+
+    return headroom >= 1 ? 0 : 1;
+}
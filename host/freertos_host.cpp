@@ -0,0 +1,362 @@
+/*
+freertos_host.cpp
+
+Host implementation of the FreeRTOS, esp_timer, esp_log, esp_heap_caps and esp_err subsets
+declared by the shim headers in host/include.
+*/
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    const Clock::time_point boot_time = Clock::now();
+
+    uint32_t current_thread_tag()
+    {
+        static std::atomic<uint32_t> next_tag{1};
+        thread_local uint32_t tag = next_tag.fetch_add(1);
+        return tag;
+    }
+}
+
+//*****************************************************************************
+// Tasks
+
+struct tskTaskControlBlock
+{
+    TaskFunction_t code;
+    void *parameters;
+};
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, uint32_t usStackDepth, void *pvParameters,
+                                   UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask, BaseType_t xCoreID)
+{
+    (void)pcName;
+    (void)usStackDepth;
+    (void)uxPriority;
+    (void)xCoreID;
+
+    // Handles are never freed, tasks in this code base run forever
+    TaskHandle_t handle = new tskTaskControlBlock{pvTaskCode, pvParameters};
+
+    std::thread([handle] { handle->code(handle->parameters); }).detach();
+
+    if (pvCreatedTask != nullptr)
+        *pvCreatedTask = handle;
+
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t xTicksToDelay)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(pdTICKS_TO_MS(xTicksToDelay)));
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete)
+{
+    (void)xTaskToDelete;
+    // Only self-deletion at the end of a task function is meaningful on the host
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)pdMS_TO_TICKS(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - boot_time).count());
+}
+
+//*****************************************************************************
+// Semaphores
+
+struct QueueDefinition
+{
+    std::mutex lock;
+    std::condition_variable cv;
+    unsigned int count;
+};
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return new QueueDefinition{{}, {}, 0};
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return new QueueDefinition{{}, {}, 1};
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime)
+{
+    std::unique_lock<std::mutex> guard(xSemaphore->lock);
+
+    auto available = [xSemaphore] { return xSemaphore->count > 0; };
+
+    if (xBlockTime == portMAX_DELAY)
+        xSemaphore->cv.wait(guard, available);
+    else if (!xSemaphore->cv.wait_for(guard, std::chrono::milliseconds(pdTICKS_TO_MS(xBlockTime)), available))
+        return pdFALSE;
+
+    xSemaphore->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+    std::lock_guard<std::mutex> guard(xSemaphore->lock);
+
+    if (xSemaphore->count > 0)
+        return pdFALSE;
+
+    xSemaphore->count++;
+    xSemaphore->cv.notify_one();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+    delete xSemaphore;
+}
+
+//*****************************************************************************
+// Critical sections, a recursive spinlock like the ESP-IDF portMUX
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    uint32_t self = current_thread_tag();
+
+    if (__atomic_load_n(&mux->owner, __ATOMIC_RELAXED) == self)
+    {
+        mux->count = mux->count + 1;
+        return;
+    }
+
+    uint32_t expected = 0;
+    while (!__atomic_compare_exchange_n(&mux->owner, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        expected = 0;
+        std::this_thread::yield();
+    }
+    mux->count = 1;
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+    mux->count = mux->count - 1;
+    if (mux->count == 0)
+        __atomic_store_n(&mux->owner, 0, __ATOMIC_RELEASE);
+}
+
+//*****************************************************************************
+// esp_timer
+
+struct esp_timer
+{
+    esp_timer_create_args_t args;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool running = false;
+    uint64_t generation = 0;
+};
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    if (create_args == nullptr || create_args->callback == nullptr || out_handle == nullptr)
+        return ESP_ERR_INVALID_ARG;
+
+    esp_timer_handle_t timer = new esp_timer();
+    timer->args = *create_args;
+    *out_handle = timer;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    std::lock_guard<std::mutex> guard(timer->lock);
+
+    if (timer->running)
+        return ESP_ERR_INVALID_STATE;
+
+    timer->running = true;
+    uint64_t generation = ++timer->generation;
+
+    std::thread([timer, period, generation] {
+        Clock::time_point next = Clock::now();
+        std::unique_lock<std::mutex> guard(timer->lock);
+
+        while (true)
+        {
+            next += std::chrono::microseconds(period);
+            if (timer->cv.wait_until(guard, next, [&] { return timer->generation != generation; }))
+                return;
+
+            guard.unlock();
+            timer->args.callback(timer->args.arg);
+            guard.lock();
+        }
+    }).detach();
+
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    std::lock_guard<std::mutex> guard(timer->lock);
+
+    if (!timer->running)
+        return ESP_ERR_INVALID_STATE;
+
+    timer->running = false;
+    timer->generation++;
+    timer->cv.notify_all();
+
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    if (timer->running)
+        return ESP_ERR_INVALID_STATE;
+
+    // The stopped timer thread may still hold the lock briefly, leak rather than race
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - boot_time).count();
+}
+
+//*****************************************************************************
+// esp_log
+
+namespace
+{
+    struct tLogLevels
+    {
+        std::mutex lock;
+        std::map<std::string, esp_log_level_t> levels;
+        esp_log_level_t default_level = ESP_LOG_INFO;
+    };
+
+    tLogLevels &log_levels = *new tLogLevels();
+
+    std::atomic<vprintf_like_t> log_vprintf{&vprintf};
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    std::lock_guard<std::mutex> guard(log_levels.lock);
+
+    if (strcmp(tag, "*") == 0)
+    {
+        log_levels.default_level = level;
+        log_levels.levels.clear();
+        return;
+    }
+    log_levels.levels[tag] = level;
+}
+
+esp_log_level_t esp_log_level_get(const char *tag)
+{
+    // Like ESP-IDF, every lookup takes the tag cache lock
+    std::lock_guard<std::mutex> guard(log_levels.lock);
+
+    auto it = log_levels.levels.find(tag);
+    return it != log_levels.levels.end() ? it->second : log_levels.default_level;
+}
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func)
+{
+    return log_vprintf.exchange(func);
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    (void)level;
+    (void)tag;
+
+    va_list args;
+    va_start(args, format);
+    log_vprintf.load()(format, args);
+    va_end(args);
+}
+
+//*****************************************************************************
+// esp_heap_caps
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    (void)caps;
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr)
+{
+    free(ptr);
+}
+
+//*****************************************************************************
+// esp_err
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    default:
+        return "UNKNOWN ERROR";
+    }
+}
+
+void _esp_error_check_failed(esp_err_t rc, const char *file, int line, const char *function, const char *expression)
+{
+    fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %s:%d\nfunction: %s\nexpression: %s\n", rc, esp_err_to_name(rc), file, line,
+            function, expression);
+    abort();
+}
+
+//*****************************************************************************
+// Uptime for the NMEA2000 library, which expects the platform to provide it
+
+extern "C" uint32_t millis()
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
@@ -0,0 +1,15 @@
+/*
+esp_intr_alloc.h
+
+Host build shim. Interrupt flags are accepted and ignored by the emulated TWAI driver.
+*/
+
+#ifndef _HOST_ESP_INTR_ALLOC_H_
+#define _HOST_ESP_INTR_ALLOC_H_
+
+#define ESP_INTR_FLAG_LEVEL1 (1 << 1)
+#define ESP_INTR_FLAG_LEVEL2 (1 << 2)
+#define ESP_INTR_FLAG_LEVEL3 (1 << 3)
+#define ESP_INTR_FLAG_IRAM (1 << 10)
+
+#endif
@@ -0,0 +1,13 @@
+/*
+projdefs.h
+
+Host build shim.
+*/
+
+#ifndef _HOST_PROJDEFS_H_
+#define _HOST_PROJDEFS_H_
+
+#define pdMS_TO_TICKS(xTimeInMs) ((TickType_t)(((TickType_t)(xTimeInMs) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000U))
+#define pdTICKS_TO_MS(xTicks) ((TickType_t)(((uint64_t)(xTicks) * (uint64_t)1000U) / (uint64_t)configTICK_RATE_HZ))
+
+#endif
@@ -0,0 +1,73 @@
+/*
+twai_host.h
+
+Controls for the virtual CAN bus behind the host TWAI driver emulation.
+
+The emulated controller is the only node the application sees. Everything else
+on the bus is represented by "remote" traffic injected with twai_host_inject.
+Remote frames and frames transmitted by the emulated controller share one wire:
+with a non-zero bitrate the bus thread paces frames by their bit-stuffed
+length and arbitrates between remote and local frames by identifier, so queue
+build-up, arbitration losses and RX overruns behave like on a real bus. With
+bitrate 0 the wire is infinitely fast, remote frames are delivered
+synchronously and local frames complete as soon as the bus thread runs.
+*/
+
+#ifndef _HOST_TWAI_HOST_H_
+#define _HOST_TWAI_HOST_H_
+
+#include "driver/twai.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*twai_host_tx_cb_t)(const twai_message_t *message, void *arg);
+typedef void (*twai_host_clear_cb_t)(void *arg);
+typedef void (*twai_host_transmit_cb_t)(const twai_message_t *message, void *arg);
+
+// Bus speed in bit/s, 0 (default) disables pacing.
+void twai_host_set_bitrate(uint32_t bitrate);
+
+// Transmit a frame from another node. Returns ESP_ERR_INVALID_STATE when the
+// emulated driver is not installed.
+esp_err_t twai_host_inject(const twai_message_t *message);
+
+// Called from the bus thread for every frame the emulated controller has
+// successfully put on the wire.
+void twai_host_set_tx_callback(twai_host_tx_cb_t cb, void *arg);
+
+// Called by twai_clear_transmit_queue once the queue is cleared, in the caller's
+// thread, e.g. to let the bus move on before the caller does.
+void twai_host_set_clear_callback(twai_host_clear_cb_t cb, void *arg);
+
+// Called by twai_transmit before the frame is queued, in the caller's thread,
+// e.g. to let another sender in between the frames of a message.
+void twai_host_set_transmit_callback(twai_host_transmit_cb_t cb, void *arg);
+
+// Whether any other node acknowledges our frames. Without acknowledgement the
+// transmit error counter rises until the controller becomes error passive.
+void twai_host_set_acknowledge(bool acknowledge);
+
+// Keep the wire busy so that nothing is transmitted, e.g. to fill the TX queue.
+void twai_host_set_bus_hold(bool hold);
+
+// Signal bus errors seen while receiving (raises REC) or, if the controller is
+// transmitting, while transmitting (raises TEC).
+void twai_host_inject_bus_errors(uint32_t count);
+
+// Raise TEC above 255 and enter bus-off immediately.
+void twai_host_force_bus_off(void);
+
+// Bits the frame keeps the wire busy, stuff bits and intermission included. The
+// bus thread paces frames by it; a bit-by-bit reference for the driver's own count.
+unsigned int twai_host_frame_bits(const twai_message_t *message);
+
+// Wait until all queued remote and local frames have been put on the wire.
+bool twai_host_wait_idle(uint32_t timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
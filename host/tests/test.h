@@ -0,0 +1,36 @@
+/*
+test.h
+
+Minimal checks for the host tests: CHECK prints the failed condition and
+marks the test failed, TEST_RESULT gives main its exit code for ctest. It exits
+right away, as the driver tasks still running would use the objects main and
+the emulator destroy on the way out.
+*/
+
+#ifndef _HOST_TESTS_TEST_H_
+#define _HOST_TESTS_TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int test_failures = 0;
+
+#define CHECK(condition)                                                                                                                     \
+    do                                                                                                                                       \
+    {                                                                                                                                        \
+        if (!(condition))                                                                                                                    \
+        {                                                                                                                                    \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);                                                    \
+            test_failures++;                                                                                                                 \
+        }                                                                                                                                    \
+    } while (0)
+
+static inline int test_result()
+{
+    fflush(nullptr);
+    _Exit(test_failures == 0 ? 0 : 1);
+}
+
+#define TEST_RESULT() test_result()
+
+#endif
@@ -0,0 +1,72 @@
+/*
+test_accounting.cpp
+
+Frames sent and received are counted against their source and PGN, with their
+exact stuffed bits, and TopPGNs puts the PGN with the most traffic first.
+*/
+
+#include "NMEA2000_esp32.h"
+#include "NMEA2000_esp32_framelen.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <string.h>
+
+#define TX_ID 0x09F80101 // PGN 129025 from source 1, priority 2
+#define TX_FRAMES 3
+#define RX_ID 0x09F11207 // PGN 127250 from source 7, priority 2
+#define RX_FRAMES 5
+
+int main()
+{
+    tNMEA2000_esp32 n2k;
+    unsigned char data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    twai_message_t message;
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    n2k.CANOpen();
+
+    for (int i = 0; i < TX_FRAMES; i++)
+        CHECK(n2k.CANSendFrame(TX_ID, 8, data, true));
+
+    memset(&message, 0, sizeof(message));
+    message.extd = 1;
+    message.identifier = RX_ID;
+    message.data_length_code = 8;
+    memcpy(message.data, data, 8);
+
+    int received = 0;
+    for (int i = 0; i < RX_FRAMES; i++)
+    {
+        tNMEA2000_esp32::tFrame frame;
+        bool got = false;
+
+        CHECK(twai_host_inject(&message) == ESP_OK);
+        for (int tries = 0; tries < 100 && !(got = n2k.CANGetFrame(frame)); tries++)
+            vTaskDelay(pdMS_TO_TICKS(1));
+        if (got)
+            received++;
+    }
+    CHECK(received == RX_FRAMES);
+
+    const tCANTrafficAccounting &traffic = n2k.GetTraffic();
+    uint32_t bits = CANFrameBits(RX_ID, 8, data);
+
+    tCANTraffic source = traffic.GetSource(7);
+    CHECK(source.Frames == RX_FRAMES);
+    CHECK(source.Bytes == RX_FRAMES * 8);
+    CHECK(source.Bits == RX_FRAMES * bits);
+    CHECK(traffic.GetSource(1).Frames == TX_FRAMES);
+    CHECK(traffic.GetSource(2).Frames == 0);
+
+    tCANTraffic top[4];
+    int count = traffic.TopPGNs(top, 4, tCANTrafficAccounting::ByFrames);
+
+    printf("%d PGNs, top %u with %u frames\n", count, (unsigned)top[0].Key, (unsigned)top[0].Frames);
+    CHECK(count == 2);
+    CHECK(top[0].Key == 127250 && top[0].Frames == RX_FRAMES);
+    CHECK(top[1].Key == 129025 && top[1].Frames == TX_FRAMES);
+    CHECK(traffic.GetPGNOverflow().Frames == 0);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,67 @@
+/*
+test_alerts.cpp
+
+Frames sent and received wake alert_task only once an alerts callback asks for
+data events: none without one, and the callback sees them once it subscribes.
+*/
+
+#include "NMEA2000_esp32.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <atomic>
+#include <string.h>
+
+#define ID 0x09F80105 // Priority 2
+#define FRAMES 20
+
+namespace
+{
+    std::atomic<int> rx_data{0};
+
+    void on_alerts(uint32_t alerts, bool)
+    {
+        if (alerts & TWAI_ALERT_RX_DATA)
+            rx_data++;
+    }
+
+    void traffic(tNMEA2000_esp32 &n2k)
+    {
+        twai_message_t message;
+        unsigned char data[8] = {};
+
+        memset(&message, 0, sizeof(message));
+        message.extd = 1;
+        message.identifier = ID;
+        message.data_length_code = 8;
+
+        for (int i = 0; i < FRAMES; i++)
+        {
+            CHECK(n2k.CANSendFrame(ID, 8, data, true));
+            CHECK(twai_host_inject(&message) == ESP_OK);
+        }
+        CHECK(twai_host_wait_idle(1000));
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
+int main()
+{
+    tNMEA2000_esp32 n2k;
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    twai_host_set_bitrate(250000);
+    n2k.CANOpen();
+
+    traffic(n2k);
+    printf("%u wakeups without a callback\n", (unsigned)n2k.GetAlertTaskWakeups());
+    CHECK(n2k.GetAlertTaskWakeups() == 0);
+
+    n2k.SetAlertsCallback(on_alerts, TWAI_ALERT_RX_DATA);
+    traffic(n2k);
+    printf("%u wakeups, %d with RX_DATA, subscribed\n", (unsigned)n2k.GetAlertTaskWakeups(), (int)rx_data);
+    CHECK(rx_data > 0);
+    CHECK(n2k.GetAlertTaskWakeups() > 0);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,82 @@
+/*
+test_bus_off.cpp
+
+Recovery from bus-off with BusOffProbeBeforeRejoin: recovery starts once the
+backoff is over, the driver reports TWAI_STATE_RECOVERING from then until it
+rejoins after the probe, never TWAI_STATE_STOPPED, and sends the frames kept
+from before the bus-off once it has rejoined.
+*/
+
+#include "NMEA2000_esp32.h"
+#include "esp_timer.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <atomic>
+
+#define ID 0x0DF80505 // Priority 3
+#define FRAMES 5
+#define BACKOFF_MS 50
+#define PROBE_MS 200
+
+namespace
+{
+    std::atomic<int> sent{0};
+
+    void on_sent(const twai_message_t *, void *)
+    {
+        sent++;
+    }
+}
+
+int main()
+{
+    tNMEA2000_esp32 n2k;
+    tNMEA2000_esp32::tBusOffRecovery recovery = {tNMEA2000_esp32::BusOffProbeBeforeRejoin, BACKOFF_MS, BACKOFF_MS * 8, PROBE_MS, true};
+    unsigned char data[8] = {};
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    twai_host_set_bitrate(250000);
+    twai_host_set_tx_callback(on_sent, nullptr);
+    n2k.SetBusOffRecovery(recovery);
+    n2k.CANOpen();
+
+    twai_host_set_bus_hold(true);
+    for (int i = 0; i < FRAMES; i++)
+        CHECK(n2k.CANSendFrame(ID, 8, data, false));
+
+    twai_host_force_bus_off();
+    twai_host_set_bus_hold(false);
+
+    int64_t start = esp_timer_get_time();
+    int64_t recovering = 0;
+    int stopped = 0;
+    twai_state_t state;
+
+    while (n2k.GetDriverState() == TWAI_STATE_RUNNING && esp_timer_get_time() - start < 1000000)
+        vTaskDelay(pdMS_TO_TICKS(1));
+
+    while ((state = n2k.GetDriverState()) != TWAI_STATE_RUNNING && esp_timer_get_time() - start < 5000000)
+    {
+        if (state == TWAI_STATE_RECOVERING && recovering == 0)
+            recovering = esp_timer_get_time();
+        if (state == TWAI_STATE_STOPPED)
+            stopped++;
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+
+    int64_t rejoined = esp_timer_get_time();
+    printf("backoff %u ms, recovering for %u ms, stopped seen %d times\n", (unsigned)((recovering - start) / 1000),
+           (unsigned)((rejoined - recovering) / 1000), stopped);
+
+    CHECK(state == TWAI_STATE_RUNNING);
+    CHECK(recovering != 0);
+    CHECK(recovering - start >= BACKOFF_MS * 1000);
+    CHECK(stopped == 0);
+    CHECK(rejoined - recovering >= PROBE_MS * 1000);
+
+    CHECK(twai_host_wait_idle(1000));
+    CHECK(sent >= FRAMES);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,86 @@
+/*
+test_framelen.cpp
+
+CANFrameBits counts stuff bits with lookup tables; the emulator builds the
+frame bit by bit. Both must agree for any id, length and data, including the
+all-zero and all-one data that stuff the most.
+*/
+
+#include "NMEA2000_esp32_framelen.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <string.h>
+
+#define RANDOM_FRAMES 200000
+
+namespace
+{
+    uint32_t xorshift(uint32_t &state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    bool agree(unsigned long id, unsigned char len, const unsigned char *data)
+    {
+        twai_message_t message;
+
+        memset(&message, 0, sizeof(message));
+        message.extd = 1;
+        message.identifier = id;
+        message.data_length_code = len;
+        memcpy(message.data, data, len);
+
+        uint32_t bits = CANFrameBits(id, len, data);
+        unsigned int reference = twai_host_frame_bits(&message);
+
+        if (bits == reference)
+            return true;
+
+        fprintf(stderr, "id %08lx len %u: %u bits, reference %u\n", id, len, (unsigned)bits, reference);
+        return false;
+    }
+}
+
+int main()
+{
+    static const unsigned long Ids[] = {0x00000000, 0x1FFFFFFF, 0x09F80100, 0x0DF80501, 0x18EEFF00, 0x15555555, 0x0AAAAAAA};
+    unsigned char data[8];
+    uint32_t seed = 0x2545F491;
+    int failed = 0;
+
+    // Worst and best case stuffing
+    for (unsigned long id : Ids)
+    {
+        for (unsigned char len = 0; len <= 8; len++)
+        {
+            memset(data, 0x00, sizeof(data));
+            failed += !agree(id, len, data);
+            memset(data, 0xFF, sizeof(data));
+            failed += !agree(id, len, data);
+            memset(data, 0x55, sizeof(data));
+            failed += !agree(id, len, data);
+        }
+    }
+
+    for (int i = 0; i < RANDOM_FRAMES && failed < 10; i++)
+    {
+        unsigned long id = xorshift(seed) & 0x1FFFFFFF;
+        unsigned char len = xorshift(seed) % 9;
+
+        for (unsigned char j = 0; j < 8; j++)
+            data[j] = (unsigned char)xorshift(seed);
+        // Long runs of equal bits are where the stuffing goes wrong
+        if (i % 4 == 0)
+            memset(data, (i & 8) ? 0xFF : 0x00, xorshift(seed) % 9);
+
+        failed += !agree(id, len, data);
+    }
+
+    CHECK(failed == 0);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,105 @@
+/*
+test_histogram.cpp
+
+  test_histogram buckets   known latencies land in the buckets they belong to:
+                           percentiles give the highest value of the bucket,
+                           never more than the maximum recorded
+  test_histogram tx_queue  a frame held back by the bus for a known time shows
+                           that time in the TX queue histogram
+*/
+
+#include "NMEA2000_esp32.h"
+#include "NMEA2000_esp32_histogram.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <string.h>
+
+#define ID 0x09F80105 // Priority 2
+#define HOLD_MS 20
+
+namespace
+{
+    void buckets()
+    {
+        tLatencyHistogram histogram;
+
+        CHECK(histogram.Summary().Count == 0);
+
+        // A value below 16 us has a bucket of its own
+        histogram.Record(7);
+        CHECK(histogram.Summary().P50Us == 7);
+
+        // 1000 us is in the bucket 992-1023, and the maximum caps the percentile
+        tLatencyHistogram one;
+        one.Record(1000);
+        CHECK(one.Summary().P50Us == 1000);
+        one.Record(1001);
+        CHECK(one.Summary().P50Us == 1001);
+        one.Record(992);
+        one.Record(1100);
+        CHECK(one.Summary().P50Us == 1023);
+
+        // 990 values of 100 us (bucket 100-103) and 10 of 5000 us (4864-5119)
+        tLatencyHistogram mixed;
+        for (int i = 0; i < 990; i++)
+            mixed.Record(100);
+        for (int i = 0; i < 10; i++)
+            mixed.Record(5000);
+
+        tLatencySummary summary = mixed.Summary();
+        printf("p50 %u, p99 %u, p99.9 %u, max %u, mean %u\n", (unsigned)summary.P50Us, (unsigned)summary.P99Us, (unsigned)summary.P999Us,
+               (unsigned)summary.MaxUs, (unsigned)summary.MeanUs);
+        CHECK(summary.Count == 1000);
+        CHECK(summary.P50Us == 103);
+        CHECK(summary.P99Us == 103);
+        CHECK(summary.P999Us == 5000);
+        CHECK(summary.MaxUs == 5000);
+        CHECK(summary.MeanUs == (990 * 101 + 10 * 4991) / 1000);
+
+        // Negative values count as 0, values past the 16.7 s limit as the limit
+        tLatencyHistogram clamped;
+        clamped.Record(-5);
+        clamped.Record(100000000);
+        summary = clamped.Summary();
+        CHECK(summary.P50Us == 0);
+        CHECK(summary.MaxUs == (1 << 24) - 1);
+    }
+
+    void tx_queue()
+    {
+        tNMEA2000_esp32 n2k;
+        unsigned char data[8] = {};
+
+        esp_log_level_set("*", ESP_LOG_ERROR);
+        n2k.CANOpen();
+
+        twai_host_set_bus_hold(true);
+        CHECK(n2k.CANSendFrame(ID, 8, data, true));
+        vTaskDelay(pdMS_TO_TICKS(HOLD_MS));
+        twai_host_set_bus_hold(false);
+        CHECK(twai_host_wait_idle(1000));
+
+        tLatencySummary summary;
+        for (int waited = 0; (summary = n2k.GetLatency(tNMEA2000_esp32::LatencyTxQueue)).Count == 0 && waited < 1000; waited++)
+            vTaskDelay(pdMS_TO_TICKS(1));
+
+        printf("%u frames, max %u us\n", (unsigned)summary.Count, (unsigned)summary.MaxUs);
+        CHECK(summary.Count == 1);
+        CHECK(summary.MaxUs >= HOLD_MS * 1000);
+        CHECK(summary.MaxUs < HOLD_MS * 1000 * 5);
+        CHECK(summary.P50Us == summary.MaxUs);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "buckets";
+
+    if (strcmp(mode, "tx_queue") == 0)
+        tx_queue();
+    else
+        buckets();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,124 @@
+/*
+test_hw_filter.cpp
+
+Frames injected through the emulated TWAI acceptance filter that BuildHwFilter
+programs. Every frame of a requested or mandatory ISO PGN must pass whatever its
+priority and source, and a PDU1 PGN whatever its destination, while frames the
+filter rejects must be outside the PGN field values it reports as accepted. A
+list too long for the filter falls back to accepting every frame.
+*/
+
+#include "NMEA2000_esp32_filter.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <string.h>
+
+namespace
+{
+    const unsigned long PGNs[] = {127250, 129029, 130306, 0};
+    const unsigned long ISORequest = 59904;
+    const unsigned char Sources[] = {0x00, 0x23, 0x7F, 0xFE};
+
+    void install(const tCANHwFilter &filter)
+    {
+        twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(GPIO_NUM_4, GPIO_NUM_5, TWAI_MODE_NORMAL);
+        twai_timing_config_t t_config = TWAI_TIMING_CONFIG_250KBITS();
+
+        g_config.rx_queue_len = 4;
+        CHECK(twai_driver_install(&g_config, &t_config, &filter.Config) == ESP_OK);
+        CHECK(twai_start() == ESP_OK);
+    }
+
+    void uninstall()
+    {
+        twai_stop();
+        twai_driver_uninstall();
+    }
+
+    // PGN field values are EDP, DP, PF and PS, bits 25-8 of the CAN id
+    unsigned long Id(int priority, unsigned long field, unsigned char source)
+    {
+        return (unsigned long)priority << 26 | field << 8 | source;
+    }
+
+    bool passes(unsigned long id)
+    {
+        twai_message_t message;
+
+        memset(&message, 0, sizeof(message));
+        message.extd = 1;
+        message.identifier = id;
+        message.data_length_code = 8;
+        twai_host_inject(&message);
+
+        return twai_receive(&message, 0) == ESP_OK && message.identifier == id;
+    }
+
+    void wanted(const unsigned long *pgns)
+    {
+        for (const unsigned long *pgn = pgns; *pgn != 0; pgn++)
+        {
+            for (int priority = 0; priority < 8; priority++)
+            {
+                for (unsigned char source : Sources)
+                    CHECK(passes(Id(priority, *pgn, source)));
+            }
+        }
+
+        // PDU1, the PS field holds the destination
+        for (unsigned long destination = 0; destination < 256; destination++)
+            CHECK(passes(Id(6, ISORequest | destination, 0x23)));
+    }
+
+    void filtered()
+    {
+        tCANHwFilter filter;
+
+        CHECK(BuildHwFilter(PGNs, filter));
+        CHECK(filter.AcceptedIds < (1UL << 18));
+        install(filter);
+
+        wanted(PGNs);
+
+        // Every PGN field value, counted once, for one priority and source. Source
+        // and priority are never filtered, so any other would count the same.
+        uint32_t accepted = 0;
+        for (unsigned long field = 0; field < (1UL << 18); field++)
+            accepted += passes(Id(3, field, 0x42)) ? 1 : 0;
+        CHECK(accepted == filter.AcceptedIds);
+
+        // The extended data page is not used by NMEA 2000 and never wanted
+        CHECK(!passes(Id(6, 0x20000 | PGNs[0], 0x23)));
+
+        uninstall();
+    }
+
+    void accept_all()
+    {
+        static unsigned long pgns[ESP32_CAN_HW_FILTER_MAX_PGNS + 2];
+        tCANHwFilter filter;
+
+        for (int i = 0; i <= ESP32_CAN_HW_FILTER_MAX_PGNS; i++)
+            pgns[i] = 0x1F000 + i;
+        pgns[ESP32_CAN_HW_FILTER_MAX_PGNS + 1] = 0;
+
+        CHECK(!BuildHwFilter(pgns, filter));
+        CHECK(filter.AcceptedIds == (1UL << 18));
+        install(filter);
+
+        wanted(PGNs);
+        CHECK(passes(Id(6, 0x20000 | PGNs[0], 0x23)));
+        CHECK(passes(Id(7, 0x0FF00, 0x23)));
+
+        uninstall();
+    }
+}
+
+int main()
+{
+    filtered();
+    accept_all();
+
+    return TEST_RESULT();
+}
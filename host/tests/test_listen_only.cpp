@@ -0,0 +1,72 @@
+/*
+test_listen_only.cpp
+
+The listen-only build never calls twai_transmit: CANSendFrame and CANSendFrames
+fail without reaching the driver, while frames from other nodes are received.
+*/
+
+#include "NMEA2000_esp32.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <atomic>
+#include <string.h>
+
+#define TX_ID 0x09F80101 // PGN 129025 from source 1, priority 2
+#define RX_ID 0x09F11207 // PGN 127250 from source 7, priority 2
+#define FRAMES 10
+
+namespace
+{
+    std::atomic<int> transmits{0};
+
+    void on_transmit(const twai_message_t *, void *)
+    {
+        transmits++;
+    }
+}
+
+int main()
+{
+    tNMEA2000_esp32 n2k;
+    tNMEA2000_esp32::tFrame frames[2];
+    unsigned char data[8] = {};
+    twai_message_t message;
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    twai_host_set_transmit_callback(on_transmit, nullptr);
+    n2k.CANOpen();
+
+    memset(frames, 0, sizeof(frames));
+    frames[0].id = frames[1].id = TX_ID;
+    frames[0].len = frames[1].len = 8;
+
+    CHECK(!n2k.CANSendFrame(TX_ID, 8, data, false));
+    CHECK(!n2k.CANSendFrame(TX_ID, 8, data, true));
+    CHECK(!n2k.CANSendFrames(frames, 2, true));
+    CHECK(transmits == 0);
+
+    memset(&message, 0, sizeof(message));
+    message.extd = 1;
+    message.identifier = RX_ID;
+    message.data_length_code = 8;
+
+    int received = 0;
+    for (int i = 0; i < FRAMES; i++)
+        CHECK(twai_host_inject(&message) == ESP_OK);
+    for (int tries = 0; tries < 100 && received < FRAMES; tries++)
+    {
+        tNMEA2000_esp32::tFrame frame;
+
+        if (n2k.CANGetFrame(frame))
+            received += frame.id == RX_ID;
+        else
+            vTaskDelay(pdMS_TO_TICKS(1));
+    }
+
+    printf("%d frames received, twai_transmit called %d times\n", received, (int)transmits);
+    CHECK(received == FRAMES);
+    CHECK(transmits == 0);
+
+    return TEST_RESULT();
+}
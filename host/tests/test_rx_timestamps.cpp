@@ -0,0 +1,113 @@
+/*
+test_rx_timestamps.cpp
+
+timestamp_error bounds how long a received frame may have waited in the TWAI RX
+queue. It must stay small when the queue was empty for a long time before the
+frame, whether the frame is found without waiting or waited for.
+
+  test_rx_timestamps found   frame queued before the first receive after CANOpen
+  test_rx_timestamps waited  RX task blocked in twai_receive across an idle gap
+  test_rx_timestamps wakeup  a burst ends the RX task's wait: the frame it wakes
+                             for and the frames queued while it wakes up must all
+                             have reached the queue after timestamp - timestamp_error
+*/
+
+#include "NMEA2000_esp32.h"
+#include "esp_timer.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <string.h>
+
+#define IDLE_MS 700
+#define MAX_ERROR_US 20000
+#define BURST 4
+
+namespace
+{
+    void inject(unsigned char tag = 0)
+    {
+        twai_message_t message;
+        memset(&message, 0, sizeof(message));
+        message.extd = 1;
+        message.identifier = 0x09F80100;
+        message.data_length_code = 8;
+        message.data[0] = tag;
+        twai_host_inject(&message);
+    }
+
+    bool receive(tNMEA2000_esp32 &n2k, tNMEA2000_esp32::tFrame &frame)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            if (n2k.CANGetFrame(frame))
+                return true;
+            vTaskDelay(pdMS_TO_TICKS(1));
+        }
+        return false;
+    }
+
+    void wakeup(tNMEA2000_esp32 &n2k)
+    {
+        tNMEA2000_esp32::tFrame frame;
+        int64_t injected[BURST];
+
+        // Delivered as injected, so each frame has reached the queue by injected[i]
+        twai_host_set_bitrate(0);
+        n2k.EnableRxTask(64);
+        n2k.CANOpen();
+        vTaskDelay(pdMS_TO_TICKS(IDLE_MS));
+
+        for (int i = 0; i < BURST; i++)
+        {
+            inject(i);
+            injected[i] = esp_timer_get_time();
+        }
+
+        for (int i = 0; i < BURST; i++)
+        {
+            CHECK(receive(n2k, frame));
+            CHECK(frame.data[0] == i);
+            CHECK(frame.timestamp - frame.timestamp_error <= injected[i]);
+            CHECK(frame.timestamp_error < MAX_ERROR_US);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool waited = argc > 1 && strcmp(argv[1], "waited") == 0;
+    tNMEA2000_esp32 n2k;
+    tNMEA2000_esp32::tFrame frame;
+
+    twai_host_set_bitrate(250000);
+
+    if (argc > 1 && strcmp(argv[1], "wakeup") == 0)
+    {
+        wakeup(n2k);
+        return TEST_RESULT();
+    }
+
+    if (waited)
+    {
+        n2k.EnableRxTask(64);
+        n2k.CANOpen();
+        vTaskDelay(pdMS_TO_TICKS(IDLE_MS));
+    }
+    else
+    {
+        // Time since boot must not count
+        vTaskDelay(pdMS_TO_TICKS(IDLE_MS));
+        n2k.CANOpen();
+    }
+
+    inject();
+    twai_host_wait_idle(100);
+
+    CHECK(receive(n2k, frame));
+    printf("timestamp_error %u us, max %u us\n", (unsigned)frame.timestamp_error, (unsigned)n2k.GetRxTimestampErrorMax());
+    CHECK(frame.timestamp_error < MAX_ERROR_US);
+    CHECK(n2k.GetRxTimestampErrorMax() < MAX_ERROR_US);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,71 @@
+/*
+test_statistics.cpp
+
+  test_statistics rates  tCANRateAverage converges on a steady count, the
+                         10 s average faster than the 60 s one
+  test_statistics tick   GetStatistics gives the frames sent and their exact
+                         bits after the one second tick
+*/
+
+#include "NMEA2000_esp32.h"
+#include "NMEA2000_esp32_framelen.h"
+#include "NMEA2000_esp32_stats.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <string.h>
+
+#define ID 0x09F80105 // Priority 2
+#define FRAMES 10
+
+namespace
+{
+    void rates()
+    {
+        tCANRateAverage average;
+
+        for (int i = 0; i < 60; i++)
+            average.Update(100);
+
+        tCANRate rate = average.Get();
+        printf("last %u, 10 s %u, 60 s %u\n", (unsigned)rate.Last1s, (unsigned)rate.Avg10s, (unsigned)rate.Avg60s);
+        CHECK(rate.Last1s == 100);
+        CHECK(rate.Avg10s == 100);
+        CHECK(rate.Avg60s >= 60 && rate.Avg60s <= 66); // 100 * (1 - 1 / e)
+    }
+
+    void tick()
+    {
+        tNMEA2000_esp32 n2k;
+        unsigned char data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+        esp_log_level_set("*", ESP_LOG_ERROR);
+        n2k.CANOpen();
+
+        for (int i = 0; i < FRAMES; i++)
+            CHECK(n2k.CANSendFrame(ID, 8, data, true));
+        CHECK(twai_host_wait_idle(1000));
+
+        tCANStatistics stats;
+        for (int waited = 0; (stats = n2k.GetStatistics()).Seconds == 0 && waited < 2000; waited++)
+            vTaskDelay(pdMS_TO_TICKS(1));
+
+        printf("%u s: %u frames, %u bits\n", (unsigned)stats.Seconds, (unsigned)stats.TxPackets, (unsigned)stats.TxBits);
+        CHECK(stats.Seconds == 1);
+        CHECK(stats.TxPackets == FRAMES);
+        CHECK(stats.TxBits == FRAMES * CANFrameBits(ID, 8, data));
+        CHECK(stats.TxPacketsPerSecond.Last1s == FRAMES);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "rates";
+
+    if (strcmp(mode, "tick") == 0)
+        tick();
+    else
+        rates();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,113 @@
+/*
+test_trace.cpp
+
+  test_trace frames  with the log level at INFO, sends and receives leave one
+                     record per frame in order, which formats to the line
+                     ESP_LOGI would have printed; below INFO they leave none
+  test_trace ring    the ring keeps the newest records and counts the ones
+                     overwritten before they were read
+*/
+
+#include "NMEA2000_esp32.h"
+#include "NMEA2000_esp32_trace.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <string.h>
+
+#define SEND_ID 0x09F80101  // PGN 129025 from source 1, priority 2
+#define SENDS_ID 0x0DF80501 // PGN 129029 from source 1, priority 3
+#define RX_ID 0x18EA0507    // PGN 59904 to address 5 from source 7, priority 6
+
+namespace
+{
+    void frames()
+    {
+        tNMEA2000_esp32 n2k;
+        tNMEA2000_esp32::tFrame frames[2];
+        tNMEA2000_esp32::tFrame frame;
+        tCANTraceRecord records[8];
+        unsigned char data[8] = {};
+        twai_message_t message;
+
+        n2k.CANOpen();
+        n2k.SetLogLevel(ESP_LOG_INFO);
+
+        memset(frames, 0, sizeof(frames));
+        for (int i = 0; i < 2; i++)
+        {
+            frames[i].id = SENDS_ID;
+            frames[i].len = 8;
+        }
+
+        memset(&message, 0, sizeof(message));
+        message.extd = 1;
+        message.identifier = RX_ID;
+        message.data_length_code = 3;
+
+        CHECK(n2k.CANSendFrame(SEND_ID, 8, data, true));
+        CHECK(n2k.CANSendFrames(frames, 2, true));
+        CHECK(twai_host_inject(&message) == ESP_OK);
+
+        bool got = false;
+        for (int tries = 0; tries < 100 && !(got = n2k.CANGetFrame(frame)); tries++)
+            vTaskDelay(pdMS_TO_TICKS(1));
+        CHECK(got);
+
+        uint32_t count = n2k.ReadTrace(records, 8);
+        CHECK(count == 4);
+        if (count == 4)
+        {
+            CHECK(records[0].Event == CANTraceSendFrame && records[0].Id == SEND_ID && records[0].Len == 8);
+            CHECK(records[1].Event == CANTraceSendFrames && records[1].Id == SENDS_ID);
+            CHECK(records[2].Event == CANTraceSendFrames && records[2].Id == SENDS_ID);
+            CHECK(records[3].Event == CANTraceGetFrame && records[3].Id == RX_ID && records[3].Len == 3);
+            CHECK(records[0].Timestamp <= records[3].Timestamp);
+
+            char line[128];
+            char expected[128];
+
+            CANTraceFormat(records[3], "NMEA2000_esp32", line, sizeof(line));
+            snprintf(expected, sizeof(expected), "I (%u) NMEA2000_esp32: CANGetFrame Len = 3, Prio = 6, PGN = 59904, Src = 7, Dst = 5",
+                     (unsigned)(records[3].Timestamp / 1000));
+            printf("%s\n", line);
+            CHECK(strcmp(line, expected) == 0);
+        }
+
+        // Below INFO nothing is recorded
+        n2k.SetLogLevel(ESP_LOG_WARN);
+        CHECK(n2k.CANSendFrame(SEND_ID, 8, data, true));
+        CHECK(n2k.ReadTrace(records, 8) == 0);
+    }
+
+    void ring()
+    {
+        static tCANTrace trace;
+        tCANTraceRecord records[ESP32_CAN_TRACE_RECORDS];
+        const uint32_t written = ESP32_CAN_TRACE_RECORDS + 10;
+
+        for (uint32_t i = 0; i < written; i++)
+            trace.Record(i, SEND_ID, 8, CANTraceSendFrame);
+
+        uint32_t count = trace.Read(records, ESP32_CAN_TRACE_RECORDS);
+
+        printf("%u read, %u lost\n", (unsigned)count, (unsigned)trace.GetLost());
+        CHECK(count == ESP32_CAN_TRACE_RECORDS);
+        CHECK(trace.GetLost() == written - ESP32_CAN_TRACE_RECORDS);
+        CHECK(count > 0 && records[0].Timestamp == written - ESP32_CAN_TRACE_RECORDS);
+        CHECK(count > 0 && records[count - 1].Timestamp == written - 1);
+        CHECK(trace.Read(records, ESP32_CAN_TRACE_RECORDS) == 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "frames";
+
+    if (strcmp(mode, "ring") == 0)
+        ring();
+    else
+        frames();
+
+    return TEST_RESULT();
+}
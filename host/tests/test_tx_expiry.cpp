@@ -0,0 +1,123 @@
+/*
+test_tx_expiry.cpp
+
+Frames that wait in the TWAI TX queue longer than their maximum age:
+
+  test_tx_expiry in_flight  when an expired frame makes the driver clear the
+                            TWAI TX queue, the frame the controller is sending
+                            stays there and must not be queued again. Here it
+                            finishes right after the clear, before the driver
+                            looks again, and must still go on the bus once, while
+                            the fresh frames behind the expired ones are sent
+                            again.
+  test_tx_expiry quiet      frames expire while the bus holds them back and
+                            nothing else is sent, so no send and no alert comes
+                            to look at them
+*/
+
+#include "NMEA2000_esp32.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <atomic>
+#include <string.h>
+
+#define ID_FRESH 0x09F80100 // Priority 2, kept for a second
+#define ID_STALE 0x19F80500 // Priority 6, expires after STALE_MS
+#define STALE_MS 50
+#define STALE 3
+
+namespace
+{
+    std::atomic<int> sent[8];
+
+    void on_sent(const twai_message_t *message, void *)
+    {
+        sent[message->data[0] & 7]++;
+    }
+
+    // The frame the controller holds finishes before the driver looks again
+    void on_clear(void *)
+    {
+        int before = sent[0];
+
+        twai_host_set_bus_hold(false);
+        for (int i = 0; i < 1000 && sent[0] == before; i++)
+            vTaskDelay(pdMS_TO_TICKS(1));
+        twai_host_set_bus_hold(true);
+    }
+
+    void send(tNMEA2000_esp32 &n2k, unsigned long id, unsigned char tag)
+    {
+        unsigned char data[8] = {tag};
+        CHECK(n2k.CANSendFrame(id, 8, data, false));
+    }
+
+    void in_flight(tNMEA2000_esp32 &n2k)
+    {
+        twai_host_set_bus_hold(true);
+
+        send(n2k, ID_FRESH, 0); // In the controller
+        for (int i = 0; i < STALE; i++)
+            send(n2k, ID_STALE, 1);
+        send(n2k, ID_FRESH, 2);
+
+        vTaskDelay(pdMS_TO_TICKS(STALE_MS + 10));
+
+        twai_host_set_clear_callback(on_clear, nullptr);
+        send(n2k, ID_FRESH, 3); // Finds the stale frames and clears the queue
+        twai_host_set_clear_callback(nullptr, nullptr);
+
+        twai_host_set_bus_hold(false);
+        CHECK(twai_host_wait_idle(1000));
+
+        tNMEA2000_esp32::tTxCompletion completion = n2k.GetTxCompletion();
+
+        printf("sent %d %d %d %d, expired %u, purges %u\n", (int)sent[0], (int)sent[1], (int)sent[2], (int)sent[3],
+               (unsigned)completion.Expired, (unsigned)completion.Purges);
+        CHECK(sent[0] == 1);
+        CHECK(sent[1] == 0);
+        CHECK(sent[2] == 1);
+        CHECK(sent[3] == 1);
+        CHECK(completion.Expired == STALE);
+        CHECK(completion.Purges == 1);
+    }
+
+    void quiet(tNMEA2000_esp32 &n2k)
+    {
+        twai_host_set_bus_hold(true);
+
+        send(n2k, ID_FRESH, 0); // In the controller
+        for (int i = 0; i < STALE; i++)
+            send(n2k, ID_STALE, 1);
+
+        vTaskDelay(pdMS_TO_TICKS(STALE_MS + 2 * ESP32_CAN_TX_EXPIRY_CHECK_MS));
+
+        tNMEA2000_esp32::tTxCompletion completion = n2k.GetTxCompletion();
+        CHECK(completion.Expired == STALE);
+        CHECK(completion.Purges == 1);
+
+        twai_host_set_bus_hold(false);
+        CHECK(twai_host_wait_idle(1000));
+        CHECK(sent[0] == 1);
+        CHECK(sent[1] == 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "in_flight";
+    tNMEA2000_esp32 n2k;
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    twai_host_set_tx_callback(on_sent, nullptr);
+    n2k.SetTxMaxAge(6, STALE_MS);
+    n2k.CANOpen();
+
+    if (strcmp(mode, "quiet") == 0)
+        quiet(n2k);
+    else
+        in_flight(n2k);
+
+    return TEST_RESULT();
+}
\ No newline at end of file
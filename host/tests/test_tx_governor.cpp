@@ -0,0 +1,61 @@
+/*
+test_tx_governor.cpp
+
+The governor decides once per message. A fast packet message that was passing
+when the load rose over the target keeps passing until its last frame, and one
+that was dropped stays dropped, so the library never counts a message as sent
+that lost a middle frame. Transport protocol frames are deferred, never dropped,
+and a new Configure takes effect at once.
+*/
+
+#include "NMEA2000_esp32_governor.h"
+#include "test.h"
+
+#define ID 0x19F80501    // PGN 129029 from source 1, priority 6
+#define TP_DT 0x1DEB0501 // TP.DT to address 5 from source 1, priority 7
+#define BITRATE 250000   // 25000 bits a 100 ms window
+
+int main()
+{
+    tCANTxGovernor governor;
+    int64_t now = 1000000;
+
+    governor.SetBitrate(BITRATE);
+    governor.Configure(6000, 5000, 6, tCANTxGovernor::Drop);
+
+    // The first frame of a message passes under the target
+    CHECK(governor.Check(ID, true, 1, now) == tCANTxGovernor::Passed);
+
+    // The load rises over the target in the middle of the message
+    governor.Count(20000, now);
+    now += 1000;
+    CHECK(governor.Check(ID, false, 1, now) == tCANTxGovernor::Passed);
+    CHECK(governor.Check(ID, false, 1, now) == tCANTxGovernor::Passed);
+    CHECK(governor.IsThrottling());
+
+    // The next message is dropped as a whole
+    CHECK(governor.Check(ID, true, 1, now) == tCANTxGovernor::Dropped);
+    CHECK(governor.Check(ID, false, 1, now) == tCANTxGovernor::Dropped);
+
+    // Messages pass again once the load falls under the release level
+    now += 250000;
+    CHECK(governor.GetLoad(now) < 5000);
+    CHECK(governor.Check(ID, true, 1, now) == tCANTxGovernor::Passed);
+    CHECK(!governor.IsThrottling());
+
+    governor.Count(20000, now);
+    now += 1000;
+    CHECK(governor.Check(TP_DT, false, 1, now) == tCANTxGovernor::Deferred);
+
+    // Priorities above 7 turn the governor off
+    governor.Configure(6000, 5000, 8, tCANTxGovernor::Drop);
+    CHECK(governor.Check(ID, true, 1, now) == tCANTxGovernor::Passed);
+
+    tCANTxGovernor::tCounters counters = governor.GetCounters();
+    CHECK(counters.Passed == 4);
+    CHECK(counters.Dropped == 2);
+    CHECK(counters.Throttles == 2);
+    CHECK(counters.Deferred == 1);
+
+    return TEST_RESULT();
+}
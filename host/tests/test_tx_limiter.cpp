@@ -0,0 +1,133 @@
+/*
+test_tx_limiter.cpp
+
+Token bucket limits on sent frames:
+
+  test_tx_limiter oversized  a Defer rule must not defer a message of more frames
+                             than its burst: no amount of waiting fills the bucket
+                             enough, so the message is dropped and counted in
+                             Oversized. Messages within the burst still pass, and
+                             are deferred once the bucket is empty.
+  test_tx_limiter refund     a message that passes the limit but finds no room in
+                             the TWAI TX queue is not charged, so the library's
+                             retries pass once there is room
+*/
+
+#include "NMEA2000_esp32.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <atomic>
+#include <string.h>
+
+#define PGN 129029
+#define ID 0x0DF80501 // PGN 129029 from source 1
+#define BURST 3
+
+namespace
+{
+    std::atomic<int> sent{0};
+
+    void on_sent(const twai_message_t *, void *)
+    {
+        sent++;
+    }
+
+    uint32_t queued()
+    {
+        twai_status_info_t status_info;
+        twai_get_status_info(&status_info);
+        return status_info.msgs_to_tx;
+    }
+
+    bool send(tNMEA2000_esp32 &n2k, int count)
+    {
+        tNMEA2000_esp32::tFrame frames[8];
+
+        memset(frames, 0, sizeof(frames));
+        for (int i = 0; i < count; i++)
+        {
+            frames[i].id = ID;
+            frames[i].len = 8;
+            frames[i].data[0] = i;
+        }
+        return n2k.CANSendFrames(frames, count);
+    }
+
+    void oversized(tNMEA2000_esp32 &n2k)
+    {
+        CHECK(n2k.GetTxLimiter().AddRule(PGN, 10, BURST, tCANTxLimiter::Defer));
+
+        // Dropped, which the sender sees as sent, and never put on the wire
+        CHECK(send(n2k, BURST + 2));
+        twai_host_wait_idle(100);
+        CHECK(sent == 0);
+
+        tCANTxLimiter::tCounters counters = n2k.GetTxLimiter().GetCounters(0);
+        CHECK(counters.Dropped == BURST + 2);
+        CHECK(counters.Oversized == BURST + 2);
+        CHECK(counters.Deferred == 0);
+
+        CHECK(send(n2k, BURST));
+        twai_host_wait_idle(100);
+        CHECK(sent == BURST);
+
+        CHECK(!send(n2k, BURST));
+
+        counters = n2k.GetTxLimiter().GetTotals();
+        CHECK(counters.Passed == BURST);
+        CHECK(counters.Deferred == BURST);
+        CHECK(counters.Dropped == BURST + 2);
+        CHECK(counters.Oversized == BURST + 2);
+    }
+
+    void refund(tNMEA2000_esp32 &n2k)
+    {
+        twai_message_t message;
+
+        CHECK(n2k.GetTxLimiter().AddRule(PGN, 10, BURST, tCANTxLimiter::Defer));
+
+        // Held bus and a full TWAI TX queue
+        memset(&message, 0, sizeof(message));
+        message.extd = 1;
+        message.identifier = ID;
+        message.data_length_code = 8;
+        twai_host_set_bus_hold(true);
+        while (queued() < ESP32_CAN_TX_QUEUE_LEN + 1)
+            twai_transmit(&message, 0);
+
+        for (int i = 0; i < 3; i++)
+            CHECK(!send(n2k, BURST));
+
+        twai_host_set_bus_hold(false);
+        CHECK(twai_host_wait_idle(1000));
+        sent = 0;
+
+        CHECK(send(n2k, BURST));
+        CHECK(twai_host_wait_idle(1000));
+        CHECK(sent == BURST);
+
+        tCANTxLimiter::tCounters counters = n2k.GetTxLimiter().GetTotals();
+        CHECK(counters.Passed == BURST);
+        CHECK(counters.Deferred == 0);
+        CHECK(counters.Dropped == 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "oversized";
+    tNMEA2000_esp32 n2k;
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    twai_host_set_tx_callback(on_sent, nullptr);
+    n2k.CANOpen();
+
+    if (strcmp(mode, "refund") == 0)
+        refund(n2k);
+    else
+        oversized(n2k);
+
+    return TEST_RESULT();
+}
+
@@ -0,0 +1,135 @@
+/*
+test_tx_scheduler.cpp
+
+With the TX scheduler, frames sent while the bus is held:
+
+  test_tx_scheduler priority  go on the wire highest priority first once it is
+                              free, frames of one priority in the order they
+                              were sent. Only the frames already handed to the
+                              TWAI driver keep their place.
+  test_tx_scheduler replace   of a latest-value PGN overwrite the one still
+                              waiting, so only the newest goes on the wire
+*/
+
+#include "NMEA2000_esp32.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <atomic>
+#include <string.h>
+
+#define LOW_ID 0x19F80501  // Priority 6
+#define HIGH_ID 0x09F80101 // PGN 129025 from source 1, priority 2
+#define FRAMES 4
+#define REPLACE_PGN 129025UL
+
+namespace
+{
+    std::atomic<int> count{0};
+    twai_message_t wire[FRAMES * 2];
+
+    void on_sent(const twai_message_t *message, void *)
+    {
+        int i = count++;
+
+        if (i < FRAMES * 2)
+            wire[i] = *message;
+    }
+
+    // Wait for the frames to be sent. The driver idles between frames while
+    // alert_task refills it from the scheduler.
+    void wait_sent(int frames)
+    {
+        for (int waited = 0; count < frames && waited < 1000; waited++)
+            vTaskDelay(pdMS_TO_TICKS(1));
+
+        // And no more than those
+        vTaskDelay(pdMS_TO_TICKS(10));
+        CHECK(twai_host_wait_idle(1000));
+        CHECK(count == frames);
+    }
+
+    void priority(tNMEA2000_esp32 &n2k)
+    {
+        unsigned char data[8] = {};
+
+        twai_host_set_bus_hold(true);
+        for (int i = 0; i < FRAMES; i++)
+        {
+            data[0] = i;
+            CHECK(n2k.CANSendFrame(LOW_ID, 8, data, false));
+        }
+        for (int i = 0; i < FRAMES; i++)
+        {
+            data[0] = i;
+            CHECK(n2k.CANSendFrame(HIGH_ID, 8, data, false));
+        }
+        twai_host_set_bus_hold(false);
+        wait_sent(FRAMES * 2);
+
+        int low = 0;
+        int high = 0;
+        int low_before_high = 0;
+
+        for (int i = 0; i < FRAMES * 2 && i < count; i++)
+        {
+            if (wire[i].identifier == HIGH_ID)
+            {
+                CHECK(wire[i].data[0] == high);
+                high++;
+            }
+            else
+            {
+                CHECK(wire[i].data[0] == low);
+                low++;
+                if (high < FRAMES)
+                    low_before_high++;
+            }
+        }
+
+        printf("%d low priority frames sent before the last high priority frame\n", low_before_high);
+        CHECK(high == FRAMES && low == FRAMES);
+        CHECK(low_before_high <= ESP32_CAN_TX_SCHEDULER_HW_DEPTH);
+    }
+
+    void replace(tNMEA2000_esp32 &n2k)
+    {
+        static const unsigned long pgns[] = {REPLACE_PGN, 0};
+        unsigned char data[8] = {};
+
+        n2k.SetTxReplacePGNs(pgns);
+
+        // The first frames go to the TWAI driver, the rest wait in the scheduler
+        twai_host_set_bus_hold(true);
+        for (int i = 0; i < ESP32_CAN_TX_SCHEDULER_HW_DEPTH + FRAMES; i++)
+        {
+            data[0] = i;
+            CHECK(n2k.CANSendFrame(HIGH_ID, 8, data, false));
+        }
+        twai_host_set_bus_hold(false);
+        wait_sent(ESP32_CAN_TX_SCHEDULER_HW_DEPTH + 1);
+
+        printf("%d frames sent, %u replaced\n", (int)count, (unsigned)n2k.GetTxReplaced());
+        for (int i = 0; i < ESP32_CAN_TX_SCHEDULER_HW_DEPTH; i++)
+            CHECK(wire[i].data[0] == i);
+        CHECK(wire[ESP32_CAN_TX_SCHEDULER_HW_DEPTH].data[0] == ESP32_CAN_TX_SCHEDULER_HW_DEPTH + FRAMES - 1);
+        CHECK(n2k.GetTxReplaced() == FRAMES - 1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "priority";
+    tNMEA2000_esp32 n2k;
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    twai_host_set_tx_callback(on_sent, nullptr);
+    n2k.CANOpen();
+
+    if (strcmp(mode, "replace") == 0)
+        replace(n2k);
+    else
+        priority(n2k);
+
+    return TEST_RESULT();
+}
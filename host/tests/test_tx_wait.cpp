@@ -0,0 +1,197 @@
+/*
+test_tx_wait.cpp
+
+Sends that wait for room in the TWAI TX queue:
+
+  test_tx_wait message   a CANSendFrames with wait_sent queues all of its frames
+                         or none, also when its deadline passes with room for
+                         some of them
+  test_tx_wait room      and queues all of them once there is room in time
+  test_tx_wait blocking  a sender waiting for room does not hold up another
+                         sender, although the TX queue is guarded by a lock
+  test_tx_wait senders   single frames sent from other tasks between the frames
+                         of a message do not take the room the message found
+*/
+
+#include "NMEA2000_esp32.h"
+#include "esp_timer.h"
+#include "test.h"
+#include "twai_host.h"
+
+#include <atomic>
+#include <string.h>
+#include <thread>
+
+#define ID 0x09F80100 // Priority 2
+#define FRAMES 4
+#define DEADLINE_MS 100
+#define COMPETITORS 2
+
+namespace
+{
+    std::atomic<int> sent{0};
+
+    void on_sent(const twai_message_t *, void *)
+    {
+        sent++;
+    }
+
+    uint32_t queued()
+    {
+        twai_status_info_t status_info;
+        twai_get_status_info(&status_info);
+        return status_info.msgs_to_tx;
+    }
+
+    // Held bus, the TX queue and the controller's buffer full but for free entries.
+    // Filled past the driver, which keeps one entry spare.
+    void fill(uint32_t free)
+    {
+        twai_message_t message;
+
+        memset(&message, 0, sizeof(message));
+        message.extd = 1;
+        message.identifier = ID;
+        message.data_length_code = 8;
+
+        twai_host_set_bus_hold(true);
+        while (queued() < ESP32_CAN_TX_QUEUE_LEN + 1 - free)
+            twai_transmit(&message, 0);
+    }
+
+    void message(tNMEA2000_esp32 &n2k, bool expect_room)
+    {
+        tNMEA2000_esp32::tFrame frames[FRAMES];
+
+        memset(frames, 0, sizeof(frames));
+        for (int i = 0; i < FRAMES; i++)
+        {
+            frames[i].id = ID;
+            frames[i].len = 8;
+        }
+
+        fill(FRAMES - 1);
+
+        std::thread release;
+        if (expect_room)
+            release = std::thread([] {
+                vTaskDelay(pdMS_TO_TICKS(DEADLINE_MS / 4));
+                twai_host_set_bus_hold(false);
+            });
+
+        uint32_t before = queued();
+        bool sent_all = n2k.CANSendFrames(frames, FRAMES, true);
+        tNMEA2000_esp32::tTxCompletion completion = n2k.GetTxCompletion();
+
+        if (expect_room)
+        {
+            release.join();
+            CHECK(sent_all);
+            CHECK(completion.TimedOut == 0);
+            CHECK(completion.Refused == 0);
+            CHECK(twai_host_wait_idle(1000));
+            CHECK(sent == (int)before + FRAMES);
+        }
+        else
+        {
+            CHECK(!sent_all);
+            CHECK(queued() == before);
+            CHECK(completion.TimedOut == 1);
+            CHECK(completion.Refused == FRAMES);
+            CHECK(completion.MaxBlockedUs >= DEADLINE_MS * 1000 / 2);
+        }
+    }
+
+    void blocking(tNMEA2000_esp32 &n2k)
+    {
+        unsigned char data[8] = {};
+
+        fill(0);
+
+        std::thread waiter([&n2k, &data] { n2k.CANSendFrame(ID, 8, data, true); });
+        vTaskDelay(pdMS_TO_TICKS(DEADLINE_MS / 4));
+
+        int64_t start = esp_timer_get_time();
+        CHECK(n2k.CANSendFrame(ID, 8, data, false));
+        int64_t took = esp_timer_get_time() - start;
+
+        printf("send beside a waiting send took %u us\n", (unsigned)took);
+        CHECK(took < DEADLINE_MS * 1000 / 2);
+
+        waiter.join();
+        twai_host_set_bus_hold(false);
+    }
+
+    // Between the first and the second frame of a message, other tasks send single
+    // frames, more than the entry the driver keeps spare
+    struct tCompetitors
+    {
+        tNMEA2000_esp32 *n2k;
+        int calls;
+        std::thread threads[COMPETITORS];
+    };
+
+    void on_transmit(const twai_message_t *, void *arg)
+    {
+        tCompetitors *competitors = (tCompetitors *)arg;
+
+        if (++competitors->calls != 2)
+            return;
+        for (std::thread &thread : competitors->threads)
+            thread = std::thread([competitors] {
+                unsigned char data[8] = {};
+                competitors->n2k->CANSendFrame(ID, 8, data, true);
+            });
+        vTaskDelay(pdMS_TO_TICKS(DEADLINE_MS / 4));
+    }
+
+    void senders(tNMEA2000_esp32 &n2k)
+    {
+        tNMEA2000_esp32::tFrame frames[FRAMES];
+        tCompetitors competitors = {&n2k, 0, {}};
+
+        memset(frames, 0, sizeof(frames));
+        for (int i = 0; i < FRAMES; i++)
+        {
+            frames[i].id = ID;
+            frames[i].len = 8;
+        }
+
+        fill(FRAMES + 1);
+        int filled = (int)queued();
+
+        twai_host_set_transmit_callback(on_transmit, &competitors);
+        bool accepted = n2k.CANSendFrames(frames, FRAMES, true);
+        twai_host_set_transmit_callback(nullptr, nullptr);
+
+        twai_host_set_bus_hold(false);
+        for (std::thread &thread : competitors.threads)
+            thread.join();
+        CHECK(twai_host_wait_idle(1000));
+
+        // The message and the single frames, the message whole or not at all
+        printf("message %s, %d frames sent\n", accepted ? "accepted" : "refused", (int)sent - filled);
+        CHECK(accepted);
+        CHECK((int)sent - filled == FRAMES + COMPETITORS);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "message";
+    tNMEA2000_esp32 n2k;
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    twai_host_set_tx_callback(on_sent, nullptr);
+    n2k.SetTxDeadline(2, DEADLINE_MS);
+    n2k.CANOpen();
+
+    if (strcmp(mode, "blocking") == 0)
+        blocking(n2k);
+    else if (strcmp(mode, "senders") == 0)
+        senders(n2k);
+    else
+        message(n2k, strcmp(mode, "room") == 0);
+
+    return TEST_RESULT();
+}
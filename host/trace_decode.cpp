@@ -0,0 +1,49 @@
+/*
+trace_decode.cpp
+
+Prints a dump of tCANTraceRecord, as read with tNMEA2000_esp32::ReadTrace and
+written out unchanged, as the log lines the driver prints without
+ESP32_CAN_TRACE.
+
+    nmea2000_esp32_trace_decode [file]
+
+Reads standard input when no file is given.
+*/
+
+#include "NMEA2000_esp32_trace.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "usage: %s [file]\n", argv[0]);
+        return 2;
+    }
+
+    FILE *input = argc == 2 ? fopen(argv[1], "rb") : stdin;
+
+    if (input == nullptr)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    tCANTraceRecord record;
+    char line[128];
+
+    while (fread(&record, sizeof(record), 1, input) == 1)
+    {
+        CANTraceFormat(record, "NMEA2000_esp32", line, sizeof(line));
+        puts(line);
+    }
+
+    if (ferror(input))
+    {
+        perror("read");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,756 @@
+/*
+twai_host.cpp
+
+Host emulation of the ESP-IDF TWAI driver on top of an in-process virtual CAN bus.
+
+The driver side keeps the semantics the NMEA2000_esp32 class depends on:
+bounded RX and TX queues, a single hardware TX buffer counted in msgs_to_tx,
+alerts that are latched until read and masked by the enabled set, acceptance
+filtering, the error counter rules of ISO 11898-1 including error passive and
+bus-off, and a recovery sequence that needs 128 * 11 recessive bits.
+*/
+
+#include "twai_host.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string.h>
+#include <thread>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct tTwaiHost
+    {
+        std::mutex lock;
+        std::condition_variable rx_cv;    // RX queue not empty
+        std::condition_variable tx_cv;    // TX queue space available
+        std::condition_variable alert_cv; // alerts triggered
+        std::condition_variable bus_cv;   // work for the bus thread
+        std::condition_variable idle_cv;  // wire became idle
+
+        bool installed = false;
+        twai_general_config_t g_config;
+        twai_filter_config_t f_config;
+        twai_state_t state = TWAI_STATE_STOPPED;
+
+        std::deque<twai_message_t> rx_queue;
+        std::deque<twai_message_t> tx_queue;
+        bool tx_buffer_full = false;
+        twai_message_t tx_buffer;
+
+        std::deque<twai_message_t> remote_queue;
+
+        uint32_t alerts_enabled = 0;
+        uint32_t alerts_triggered = 0;
+
+        uint32_t tec = 0;
+        uint32_t rec = 0;
+        bool above_warn = false;
+        bool error_passive = false;
+        bool recovery_pending = false;
+
+        uint32_t tx_failed_count = 0;
+        uint32_t rx_missed_count = 0;
+        uint32_t rx_overrun_count = 0;
+        uint32_t arb_lost_count = 0;
+        uint32_t bus_error_count = 0;
+
+        uint32_t bitrate = 0;
+        bool acknowledge = true;
+        bool bus_hold = false;
+        bool busy = false;
+
+        twai_host_tx_cb_t tx_callback = nullptr;
+        void *tx_callback_arg = nullptr;
+        twai_host_clear_cb_t clear_callback = nullptr;
+        void *clear_callback_arg = nullptr;
+        twai_host_transmit_cb_t transmit_callback = nullptr;
+        void *transmit_callback_arg = nullptr;
+
+        bool thread_started = false;
+    };
+
+    // Never destroyed, the bus thread and FreeRTOS tasks outlive static destruction.
+    tTwaiHost &host = *new tTwaiHost();
+
+    TickType_t forever = portMAX_DELAY;
+
+    template <typename Pred>
+    bool wait_for(std::condition_variable &cv, std::unique_lock<std::mutex> &guard, TickType_t ticks, Pred pred)
+    {
+        if (ticks == forever)
+        {
+            cv.wait(guard, pred);
+            return true;
+        }
+        if (ticks == 0)
+            return pred();
+        return cv.wait_for(guard, std::chrono::milliseconds(pdTICKS_TO_MS(ticks)), pred);
+    }
+
+    void raise_alert(uint32_t alert)
+    {
+        host.alerts_triggered |= alert & host.alerts_enabled;
+        if (host.alerts_triggered != 0)
+            host.alert_cv.notify_all();
+    }
+
+    void update_error_state()
+    {
+        bool above_warn = host.tec >= 96 || host.rec >= 96;
+        bool error_passive = host.tec >= 128 || host.rec >= 128;
+
+        if (above_warn != host.above_warn)
+            raise_alert(above_warn ? TWAI_ALERT_ABOVE_ERR_WARN : TWAI_ALERT_BELOW_ERR_WARN);
+        if (error_passive != host.error_passive)
+            raise_alert(error_passive ? TWAI_ALERT_ERR_PASS : TWAI_ALERT_ERR_ACTIVE);
+
+        host.above_warn = above_warn;
+        host.error_passive = error_passive;
+
+        if (host.tec > 255 && host.state == TWAI_STATE_RUNNING)
+        {
+            host.state = TWAI_STATE_BUS_OFF;
+            host.tec = 128; // The controller counts recovery down from here
+            raise_alert(TWAI_ALERT_BUS_OFF);
+        }
+    }
+
+    bool filter_accepts(const twai_message_t &message)
+    {
+        const twai_filter_config_t &f = host.f_config;
+        uint32_t id = message.identifier;
+
+        if (!message.extd)
+        {
+            uint32_t bits = (id << 21) | (message.rtr ? 0x00100000 : 0);
+            return ((bits ^ f.acceptance_code) & ~f.acceptance_mask & 0xFFF00000) == 0;
+        }
+
+        if (f.single_filter)
+        {
+            uint32_t bits = (id << 3) | (message.rtr ? 0x4 : 0);
+            return ((bits ^ f.acceptance_code) & ~f.acceptance_mask & 0xFFFFFFFC) == 0;
+        }
+
+        // Dual filter mode compares only ID[28:13] of extended frames
+        uint32_t bits = (id >> 13) & 0xFFFF;
+        bool filter1 = ((bits ^ (f.acceptance_code >> 16)) & ~(f.acceptance_mask >> 16) & 0xFFFF) == 0;
+        bool filter2 = ((bits ^ f.acceptance_code) & ~f.acceptance_mask & 0xFFFF) == 0;
+        return filter1 || filter2;
+    }
+
+    void deliver(const twai_message_t &message)
+    {
+        if (host.state != TWAI_STATE_RUNNING || !filter_accepts(message))
+            return;
+
+        if (host.rx_queue.size() >= host.g_config.rx_queue_len)
+        {
+            host.rx_missed_count++;
+            raise_alert(TWAI_ALERT_RX_QUEUE_FULL);
+            return;
+        }
+
+        host.rx_queue.push_back(message);
+        host.rx_cv.notify_one();
+        raise_alert(TWAI_ALERT_RX_DATA);
+
+        if (host.rec > 0)
+        {
+            host.rec--;
+            update_error_state();
+        }
+    }
+
+    // Move the next queued frame into the single hardware TX buffer
+    void load_tx_buffer()
+    {
+        if (host.tx_buffer_full || host.tx_queue.empty())
+            return;
+
+        host.tx_buffer = host.tx_queue.front();
+        host.tx_queue.pop_front();
+        host.tx_buffer_full = true;
+        host.tx_cv.notify_one();
+    }
+
+    bool local_ready()
+    {
+        return host.tx_buffer_full && host.state == TWAI_STATE_RUNNING && host.g_config.mode != TWAI_MODE_LISTEN_ONLY;
+    }
+
+    unsigned int frame_bits(const twai_message_t &message)
+    {
+        unsigned char bits[128];
+        unsigned int n = 0;
+
+        auto put = [&](uint32_t value, int count) {
+            for (int i = count - 1; i >= 0; i--)
+                bits[n++] = (value >> i) & 1;
+        };
+
+        unsigned int len = message.data_length_code > 8 ? 8 : message.data_length_code;
+
+        put(0, 1); // SOF
+        if (message.extd)
+        {
+            put(message.identifier >> 18, 11);
+            put(1, 1); // SRR
+            put(1, 1); // IDE
+            put(message.identifier, 18);
+            put(message.rtr, 1);
+            put(0, 2); // r1, r0
+        }
+        else
+        {
+            put(message.identifier, 11);
+            put(message.rtr, 1);
+            put(0, 2); // IDE, r0
+        }
+        put(message.data_length_code, 4);
+        if (!message.rtr)
+        {
+            for (unsigned int i = 0; i < len; i++)
+                put(message.data[i], 8);
+        }
+
+        uint32_t crc = 0;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            uint32_t next = bits[i] ^ ((crc >> 14) & 1);
+            crc = (crc << 1) & 0x7FFF;
+            if (next)
+                crc ^= 0x4599;
+        }
+        put(crc, 15);
+
+        unsigned int stuff = 0, run = 0;
+        unsigned char last = 2;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            if (bits[i] == last)
+                run++;
+            else
+            {
+                last = bits[i];
+                run = 1;
+            }
+            if (run == 5)
+            {
+                stuff++;
+                last = !last;
+                run = 1;
+            }
+        }
+
+        // CRC delimiter, ACK slot, ACK delimiter, EOF and intermission
+        return n + stuff + 3 + 7 + 3;
+    }
+
+    void bus_thread()
+    {
+        std::unique_lock<std::mutex> guard(host.lock);
+        Clock::time_point wire_free = Clock::now();
+
+        while (true)
+        {
+            host.busy = false;
+            host.idle_cv.notify_all();
+            bool idle = false;
+            host.bus_cv.wait(guard, [&idle] {
+                bool ready = !host.bus_hold && (host.recovery_pending || !host.remote_queue.empty() || local_ready());
+                idle |= !ready;
+                return ready;
+            });
+            host.busy = true;
+
+            if (host.recovery_pending)
+            {
+                // 128 occurrences of 11 consecutive recessive bits
+                if (host.bitrate != 0)
+                {
+                    Clock::time_point done = std::max(wire_free, Clock::now()) + std::chrono::nanoseconds(1408ULL * 1000000000ULL / host.bitrate);
+                    guard.unlock();
+                    std::this_thread::sleep_until(done);
+                    guard.lock();
+                    wire_free = done;
+                }
+                if (host.state == TWAI_STATE_RECOVERING)
+                {
+                    host.state = TWAI_STATE_STOPPED;
+                    host.tec = 0;
+                    host.rec = 0;
+                    update_error_state();
+                    raise_alert(TWAI_ALERT_BUS_RECOVERED);
+                }
+                host.recovery_pending = false;
+                continue;
+            }
+
+            // Arbitration: the lowest identifier wins the wire
+            bool local = local_ready();
+            bool remote = !host.remote_queue.empty();
+
+            if (local && remote)
+            {
+                uint32_t local_id = host.tx_buffer.extd ? host.tx_buffer.identifier : host.tx_buffer.identifier << 18;
+                const twai_message_t &r = host.remote_queue.front();
+                uint32_t remote_id = r.extd ? r.identifier : r.identifier << 18;
+
+                if (remote_id < local_id)
+                {
+                    local = false;
+                    host.arb_lost_count++;
+                    raise_alert(TWAI_ALERT_ARB_LOST);
+                }
+                else
+                    remote = false;
+            }
+
+            twai_message_t message = local ? host.tx_buffer : host.remote_queue.front();
+
+            if (host.bitrate != 0)
+            {
+                // A frame waiting when the last one ends follows it on the wire however
+                // late this thread wakes up, so that a backlog loads the bus 100%
+                Clock::time_point now = Clock::now();
+                if (idle && wire_free < now)
+                    wire_free = now;
+                wire_free += std::chrono::nanoseconds((uint64_t)frame_bits(message) * 1000000000ULL / host.bitrate);
+                guard.unlock();
+                std::this_thread::sleep_until(wire_free);
+                guard.lock();
+            }
+
+            if (!local)
+            {
+                host.remote_queue.pop_front();
+                deliver(message);
+                continue;
+            }
+
+            // The state may have changed while the frame was on the wire
+            if (!host.tx_buffer_full || host.state != TWAI_STATE_RUNNING)
+                continue;
+
+            if (host.acknowledge || host.g_config.mode == TWAI_MODE_NO_ACK)
+            {
+                if (host.tec > 0)
+                    host.tec--;
+                host.tx_buffer_full = false;
+                update_error_state();
+
+                twai_host_tx_cb_t cb = host.tx_callback;
+                void *arg = host.tx_callback_arg;
+                if (cb != nullptr)
+                {
+                    guard.unlock();
+                    cb(&message, arg);
+                    guard.lock();
+                }
+
+                load_tx_buffer();
+                raise_alert(TWAI_ALERT_TX_SUCCESS | (host.tx_buffer_full ? 0 : TWAI_ALERT_TX_IDLE));
+            }
+            else
+            {
+                // ACK error. An error passive transmitter does not raise TEC for it.
+                host.bus_error_count++;
+                raise_alert(TWAI_ALERT_BUS_ERROR);
+                if (!host.error_passive)
+                    host.tec += 8;
+                update_error_state();
+
+                if (message.ss)
+                {
+                    host.tx_buffer_full = false;
+                    host.tx_failed_count++;
+                    load_tx_buffer();
+                    raise_alert(TWAI_ALERT_TX_FAILED | (host.tx_buffer_full ? 0 : TWAI_ALERT_TX_IDLE));
+                }
+                else
+                {
+                    raise_alert(TWAI_ALERT_TX_RETRIED);
+                }
+
+                // Without pacing, give other threads a chance while retrying forever
+                if (host.bitrate == 0)
+                {
+                    guard.unlock();
+                    std::this_thread::yield();
+                    guard.lock();
+                }
+            }
+        }
+    }
+
+    void start_bus_thread()
+    {
+        if (host.thread_started)
+            return;
+        host.thread_started = true;
+        std::thread(bus_thread).detach();
+    }
+}
+
+//*****************************************************************************
+esp_err_t twai_driver_install(const twai_general_config_t *g_config, const twai_timing_config_t *t_config, const twai_filter_config_t *f_config)
+{
+    if (g_config == nullptr || t_config == nullptr || f_config == nullptr || g_config->rx_queue_len == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (host.installed)
+        return ESP_ERR_INVALID_STATE;
+
+    host.installed = true;
+    host.g_config = *g_config;
+    host.f_config = *f_config;
+    host.state = TWAI_STATE_STOPPED;
+    host.alerts_enabled = g_config->alerts_enabled;
+    host.alerts_triggered = 0;
+    host.tec = host.rec = 0;
+    host.above_warn = host.error_passive = false;
+    host.tx_failed_count = host.rx_missed_count = host.rx_overrun_count = 0;
+    host.arb_lost_count = host.bus_error_count = 0;
+    host.rx_queue.clear();
+    host.tx_queue.clear();
+    host.tx_buffer_full = false;
+
+    start_bus_thread();
+
+    return ESP_OK;
+}
+
+esp_err_t twai_driver_uninstall(void)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed)
+        return ESP_ERR_INVALID_STATE;
+    if (host.state != TWAI_STATE_STOPPED && host.state != TWAI_STATE_BUS_OFF)
+        return ESP_ERR_INVALID_STATE;
+
+    host.installed = false;
+    host.rx_queue.clear();
+    host.tx_queue.clear();
+    host.tx_buffer_full = false;
+    host.remote_queue.clear();
+
+    return ESP_OK;
+}
+
+esp_err_t twai_start(void)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed || host.state != TWAI_STATE_STOPPED)
+        return ESP_ERR_INVALID_STATE;
+
+    host.rx_queue.clear();
+    host.state = TWAI_STATE_RUNNING;
+    host.bus_cv.notify_all();
+
+    return ESP_OK;
+}
+
+esp_err_t twai_stop(void)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed || host.state != TWAI_STATE_RUNNING)
+        return ESP_ERR_INVALID_STATE;
+
+    host.state = TWAI_STATE_STOPPED;
+    host.tx_queue.clear();
+    host.tx_buffer_full = false;
+    host.tx_cv.notify_all();
+
+    return ESP_OK;
+}
+
+esp_err_t twai_transmit(const twai_message_t *message, TickType_t ticks_to_wait)
+{
+    if (message == nullptr || (message->data_length_code > TWAI_FRAME_MAX_DLC && !message->dlc_non_comp))
+        return ESP_ERR_INVALID_ARG;
+
+    std::unique_lock<std::mutex> guard(host.lock);
+
+    twai_host_transmit_cb_t cb = host.transmit_callback;
+    void *arg = host.transmit_callback_arg;
+    if (cb != nullptr)
+    {
+        guard.unlock();
+        cb(message, arg);
+        guard.lock();
+    }
+
+    if (!host.installed || host.state != TWAI_STATE_RUNNING)
+        return ESP_ERR_INVALID_STATE;
+    if (host.g_config.mode == TWAI_MODE_LISTEN_ONLY)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    if (!host.tx_buffer_full && host.tx_queue.empty())
+    {
+        host.tx_buffer = *message;
+        host.tx_buffer_full = true;
+        host.bus_cv.notify_all();
+        return ESP_OK;
+    }
+
+    bool space = wait_for(host.tx_cv, guard, ticks_to_wait, [] {
+        return host.tx_queue.size() < host.g_config.tx_queue_len || host.state != TWAI_STATE_RUNNING;
+    });
+
+    if (host.state != TWAI_STATE_RUNNING)
+        return ESP_ERR_INVALID_STATE;
+    if (!space)
+        return ESP_ERR_TIMEOUT;
+
+    host.tx_queue.push_back(*message);
+    load_tx_buffer();
+    host.bus_cv.notify_all();
+
+    return ESP_OK;
+}
+
+esp_err_t twai_receive(twai_message_t *message, TickType_t ticks_to_wait)
+{
+    if (message == nullptr)
+        return ESP_ERR_INVALID_ARG;
+
+    std::unique_lock<std::mutex> guard(host.lock);
+
+    if (!host.installed)
+        return ESP_ERR_INVALID_STATE;
+
+    if (!wait_for(host.rx_cv, guard, ticks_to_wait, [] { return !host.rx_queue.empty(); }))
+        return ESP_ERR_TIMEOUT;
+
+    *message = host.rx_queue.front();
+    host.rx_queue.pop_front();
+
+    return ESP_OK;
+}
+
+esp_err_t twai_read_alerts(uint32_t *alerts, TickType_t ticks_to_wait)
+{
+    if (alerts == nullptr)
+        return ESP_ERR_INVALID_ARG;
+
+    std::unique_lock<std::mutex> guard(host.lock);
+
+    if (!host.installed)
+        return ESP_ERR_INVALID_STATE;
+
+    bool triggered = wait_for(host.alert_cv, guard, ticks_to_wait, [] { return host.alerts_triggered != 0; });
+
+    *alerts = host.alerts_triggered;
+    host.alerts_triggered = 0;
+
+    return triggered ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t twai_reconfigure_alerts(uint32_t alerts_enabled, uint32_t *current_alerts)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed)
+        return ESP_ERR_INVALID_STATE;
+
+    if (current_alerts != nullptr)
+        *current_alerts = host.alerts_triggered;
+    host.alerts_triggered = 0;
+    host.alerts_enabled = alerts_enabled;
+
+    return ESP_OK;
+}
+
+esp_err_t twai_initiate_recovery(void)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed || host.state != TWAI_STATE_BUS_OFF)
+        return ESP_ERR_INVALID_STATE;
+
+    // Like the ESP-IDF driver, recovery discards everything waiting to be sent
+    host.tx_queue.clear();
+    host.tx_buffer_full = false;
+    host.tx_cv.notify_all();
+
+    host.state = TWAI_STATE_RECOVERING;
+    host.recovery_pending = true;
+    host.bus_cv.notify_all();
+
+    return ESP_OK;
+}
+
+esp_err_t twai_get_status_info(twai_status_info_t *status_info)
+{
+    if (status_info == nullptr)
+        return ESP_ERR_INVALID_ARG;
+
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed)
+        return ESP_ERR_INVALID_STATE;
+
+    status_info->state = host.state;
+    status_info->msgs_to_tx = host.tx_queue.size() + (host.tx_buffer_full ? 1 : 0);
+    status_info->msgs_to_rx = host.rx_queue.size();
+    status_info->tx_error_counter = host.tec;
+    status_info->rx_error_counter = host.rec;
+    status_info->tx_failed_count = host.tx_failed_count;
+    status_info->rx_missed_count = host.rx_missed_count;
+    status_info->rx_overrun_count = host.rx_overrun_count;
+    status_info->arb_lost_count = host.arb_lost_count;
+    status_info->bus_error_count = host.bus_error_count;
+
+    return ESP_OK;
+}
+
+esp_err_t twai_clear_transmit_queue(void)
+{
+    std::unique_lock<std::mutex> guard(host.lock);
+
+    if (!host.installed)
+        return ESP_ERR_INVALID_STATE;
+
+    // The frame already in the TX buffer is not affected
+    host.tx_queue.clear();
+    host.tx_cv.notify_all();
+
+    twai_host_clear_cb_t cb = host.clear_callback;
+    void *arg = host.clear_callback_arg;
+    guard.unlock();
+
+    if (cb != nullptr)
+        cb(arg);
+
+    return ESP_OK;
+}
+
+esp_err_t twai_clear_receive_queue(void)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed)
+        return ESP_ERR_INVALID_STATE;
+
+    host.rx_queue.clear();
+
+    return ESP_OK;
+}
+
+//*****************************************************************************
+void twai_host_set_bitrate(uint32_t bitrate)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+    host.bitrate = bitrate;
+}
+
+esp_err_t twai_host_inject(const twai_message_t *message)
+{
+    if (message == nullptr)
+        return ESP_ERR_INVALID_ARG;
+
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed)
+        return ESP_ERR_INVALID_STATE;
+
+    if (host.bitrate == 0 && !host.bus_hold && host.remote_queue.empty())
+    {
+        deliver(*message);
+        return ESP_OK;
+    }
+
+    host.remote_queue.push_back(*message);
+    host.bus_cv.notify_all();
+
+    return ESP_OK;
+}
+
+void twai_host_set_tx_callback(twai_host_tx_cb_t cb, void *arg)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+    host.tx_callback = cb;
+    host.tx_callback_arg = arg;
+}
+
+unsigned int twai_host_frame_bits(const twai_message_t *message)
+{
+    return frame_bits(*message);
+}
+
+void twai_host_set_clear_callback(twai_host_clear_cb_t cb, void *arg)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+    host.clear_callback = cb;
+    host.clear_callback_arg = arg;
+}
+
+void twai_host_set_transmit_callback(twai_host_transmit_cb_t cb, void *arg)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+    host.transmit_callback = cb;
+    host.transmit_callback_arg = arg;
+}
+
+void twai_host_set_acknowledge(bool acknowledge)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+    host.acknowledge = acknowledge;
+    host.bus_cv.notify_all();
+}
+
+void twai_host_set_bus_hold(bool hold)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+    host.bus_hold = hold;
+    host.bus_cv.notify_all();
+}
+
+void twai_host_inject_bus_errors(uint32_t count)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed || host.state != TWAI_STATE_RUNNING)
+        return;
+
+    for (uint32_t i = 0; i < count && host.state == TWAI_STATE_RUNNING; i++)
+    {
+        host.bus_error_count++;
+        if (host.tx_buffer_full)
+            host.tec += 8;
+        else
+            host.rec++;
+        raise_alert(TWAI_ALERT_BUS_ERROR);
+        update_error_state();
+    }
+}
+
+void twai_host_force_bus_off(void)
+{
+    std::lock_guard<std::mutex> guard(host.lock);
+
+    if (!host.installed || host.state != TWAI_STATE_RUNNING)
+        return;
+
+    host.tec = 256;
+    update_error_state();
+}
+
+bool twai_host_wait_idle(uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> guard(host.lock);
+
+    return host.idle_cv.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+                                 [] { return !host.busy && !local_ready() && host.remote_queue.empty(); });
+}